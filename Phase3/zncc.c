@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <string.h>
+#include <unistd.h>
 #include "lodepng/lodepng.h"
 #include <sys/time.h> // For gettimeofday on Linux
 
@@ -66,6 +68,38 @@ void resizegray(const uint8_t *imageL, const uint8_t *imageR, uint8_t *resizedL,
     }
 }
 
+// Integral images (summed-area tables) of a grayscale image
+typedef struct
+{
+    uint32_t w, h;  // Size of the source image
+    uint32_t stride; // Row length of the tables (w + 1)
+    int64_t *sum;   // (h + 1) x (w + 1) table of pixel sums
+    int64_t *sqsum; // (h + 1) x (w + 1) table of squared pixel sums
+} IntegralImage;
+
+// Sum of the table over rows [r0, r1) and columns [c0, c1)
+static inline int64_t RectSum(const int64_t *table, uint32_t stride, int32_t r0, int32_t r1, int32_t c0, int32_t c1)
+{
+    return table[r1 * stride + c1] - table[r0 * stride + c1] - table[r1 * stride + c0] + table[r0 * stride + c0];
+}
+
+/*
+ * ZNCC of a window from its integer sums, with the same convention as CALCZNCC:
+ * the means are divided by the nominal block size bsize while only the n valid taps
+ * are accumulated. Everything is scaled by bsize^2 so the statistics stay exact.
+ * Returns -1 (never selected) when one of the windows has no variance.
+ */
+static inline double ZNCCFromSums(int64_t n, int64_t bsize, int64_t sl, int64_t sr, int64_t sll, int64_t srr, int64_t slr)
+{
+    int64_t num = bsize * bsize * slr - 2 * bsize * sl * sr + n * sl * sr;
+    int64_t lvar = bsize * bsize * sll - 2 * bsize * sl * sl + n * sl * sl;
+    int64_t rvar = bsize * bsize * srr - 2 * bsize * sr * sr + n * sr * sr;
+
+    if (lvar <= 0 || rvar <= 0)
+        return -1;
+    return num / (sqrt((double)lvar) * sqrt((double)rvar));
+}
+
 uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_t h, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
 {
     /* Disparity map computation */
@@ -160,6 +194,153 @@ uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_
     return dmap;
 }
 
+void BuildIntegralImage(IntegralImage *ii, const uint8_t *image, uint32_t w, uint32_t h)
+{
+    /* Summed-area tables of the pixel values and of their squares */
+    uint32_t stride = w + 1;
+    int32_t i, j;
+
+    ii->w = w;
+    ii->h = h;
+    ii->stride = stride;
+    ii->sum = (int64_t *)malloc((size_t)stride * (h + 1) * sizeof(int64_t));
+    ii->sqsum = (int64_t *)malloc((size_t)stride * (h + 1) * sizeof(int64_t));
+
+    // The first row and column stay zero so that RectSum needs no border cases
+    for (j = 0; j < stride; j++)
+    {
+        ii->sum[j] = 0;
+        ii->sqsum[j] = 0;
+    }
+
+    // Prefix sums along every row
+    for (i = 0; i < h; i++)
+    {
+        int64_t s = 0, sq = 0;
+        int64_t *sum_row = ii->sum + (i + 1) * stride;
+        int64_t *sqsum_row = ii->sqsum + (i + 1) * stride;
+
+        sum_row[0] = 0;
+        sqsum_row[0] = 0;
+        for (j = 0; j < w; j++)
+        {
+            s += image[i * w + j];
+            sq += image[i * w + j] * image[i * w + j];
+            sum_row[j + 1] = s;
+            sqsum_row[j + 1] = sq;
+        }
+    }
+
+    // Accumulating the rows downwards
+    for (i = 1; i < h; i++)
+    {
+        int64_t *sum_row = ii->sum + (i + 1) * stride;
+        int64_t *sqsum_row = ii->sqsum + (i + 1) * stride;
+        const int64_t *sum_prev = sum_row - stride;
+        const int64_t *sqsum_prev = sqsum_row - stride;
+        for (j = 1; j < stride; j++)
+        {
+            sum_row[j] += sum_prev[j];
+            sqsum_row[j] += sqsum_prev[j];
+        }
+    }
+}
+
+void FreeIntegralImage(IntegralImage *ii)
+{
+    free(ii->sum);
+    free(ii->sqsum);
+    ii->sum = NULL;
+    ii->sqsum = NULL;
+}
+
+uint8_t *CALCZNCC_SAT(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_t h, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /* Disparity map computation with window means and variances read from integral images */
+    int32_t imsize = w * h;    // Size of the image
+    int32_t bsize = bsx * bsy; // Block size
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+    int32_t i, j;     // Indices for rows and colums respectively
+    int32_t r0, r1;   // Rows of the window clipped to the image, [r0, r1)
+    int32_t c0, c1;   // Columns of the left window clipped to both images, [c0, c1)
+    int32_t r, c;
+    int32_t d;        // Disparity value
+    int64_t n;        // Number of valid taps in the window
+    int64_t sl, sr, sll, srr, slr;
+    double current_score;
+
+    int32_t best_d;
+    double best_score;
+
+    BuildIntegralImage(&iil, left, w, h);
+    BuildIntegralImage(&iir, right, w, h);
+
+    for (i = 0; i < h; i++)
+    {
+        // The vertical extent of the window does not depend on j or d
+        r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+        r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+
+        for (j = 0; j < w; j++)
+        {
+            best_d = maxd;
+            best_score = -1;
+            for (d = mind; d <= maxd; d++)
+            {
+                // Same taps as the border checks of CALCZNCC: both j + j_b and j + j_b - d inside the image
+                c0 = j - bsx / 2;
+                if (c0 < 0)
+                    c0 = 0;
+                if (c0 < d)
+                    c0 = d;
+                c1 = j + bsx / 2;
+                if (c1 > w)
+                    c1 = w;
+                if (c1 > (int32_t)w + d) // Signed: w + d is negative for d < -w
+                    c1 = (int32_t)w + d;
+                if (c1 <= c0 || r1 <= r0)
+                    continue;
+
+                n = (int64_t)(r1 - r0) * (c1 - c0);
+                sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+
+                // Only the cross term still needs the window itself
+                slr = 0;
+                for (r = r0; r < r1; r++)
+                {
+                    const uint8_t *lrow = left + r * w;
+                    const uint8_t *rrow = right + r * w - d;
+                    int32_t acc = 0;
+                    for (c = c0; c < c1; c++)
+                    {
+                        acc += lrow[c] * rrow[c];
+                    }
+                    slr += acc;
+                }
+
+                current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                // Selecting the best disparity
+                if (current_score > best_score)
+                {
+                    best_score = current_score;
+                    best_d = d;
+                }
+            }
+            dmap[i * w + j] = (uint8_t)abs(best_d); // Considering both Left to Right and Right to left disparities
+        }
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
+
 void normalize_dmap(uint8_t *arr, uint32_t w, uint32_t h)
 {
     uint8_t max = 0;
@@ -246,7 +427,7 @@ uint8_t *OcclusionFill(const uint8_t *map, uint32_t w, uint32_t h, uint32_t nsiz
     return result;
 }
 
-int32_t main()
+int32_t main(int32_t argc, char **argv)
 {
     const char* inputFilename1 = "im0.png"; // Left image filename
     const char* inputFilename2 = "im1.png"; // Right image filename
@@ -267,7 +448,23 @@ int32_t main()
     uint32_t imsize;
 
     struct timeval start_time, end_time; // Variables to hold start and end timestamps
-  
+    uint8_t *(*engine)(const uint8_t *, const uint8_t *, uint32_t, uint32_t, int32_t, int32_t, int32_t, int32_t) = CALCZNCC;
+    int32_t opt;
+
+    // Parsing the command line: -e naive|sat selects the disparity engine
+    while ((opt = getopt(argc, argv, "e:")) != -1)
+    {
+        if (opt == 'e' && strcmp(optarg, "naive") == 0)
+            engine = CALCZNCC;
+        else if (opt == 'e' && strcmp(optarg, "sat") == 0)
+            engine = CALCZNCC_SAT;
+        else
+        {
+            printf("Usage: %s [-e naive|sat]\n", argv[0]);
+            return -1;
+        }
+    }
+
     /// Reading the images into memory
     OriginalImageL = ReadImage(inputFilename1, &w1, &h1);
     OriginalImageR = ReadImage(inputFilename2, &w2, &h2);
@@ -295,8 +492,8 @@ int32_t main()
 
     // Calculating the disparity maps
     printf("Computing maps with zncc...\n");
-    DisparityLR = CALCZNCC(ImageL, ImageR, Width, Height, BSX, BSY, MINDISP, MAXDISP);
-    DisparityRL = CALCZNCC(ImageR, ImageL, Width, Height, BSX, BSY, -MAXDISP, MINDISP);
+    DisparityLR = engine(ImageL, ImageR, Width, Height, BSX, BSY, MINDISP, MAXDISP);
+    DisparityRL = engine(ImageR, ImageL, Width, Height, BSX, BSY, -MAXDISP, MINDISP);
     // Cross-checking
     printf("Performing cross-checking...\n");
     DisparityLRCC = CrossCheck(DisparityLR, DisparityRL, Width * Height, MAXDISP, THRESHOLD);
@@ -0,0 +1,313 @@
+#include <omp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lodepng/lodepng.h"
+#include "zncc.h"
+
+/*
+ * Scaling benchmark of the Phase 4 pipeline. Every configuration of the matrix
+ * (thread count x image size) runs the stages of the program (resize, LR and RL
+ * maps, cross-check, fill, normalization) warmup times untimed, then reps timed
+ * times; the median and 95th percentile of every stage are written as CSV with the
+ * speedup and parallel efficiency against one thread.
+ *
+ * Strong scaling keeps each size of -s fixed while the threads grow. Weak scaling
+ * gives every thread the same number of rows: t threads process the first t / N
+ * of the image height, N being the largest thread count. Sizes are taken as
+ * the first rows of the input pair, which keeps the content comparable.
+ *
+ * Build: gcc -O2 -fopenmp bench_scaling.c $(ls zncc_*.c | grep -v parallel) lodepng/lodepng.c -o bench_scaling -lm
+ */
+
+#define THRESHOLD 2    // Threshold for cross-checking, as in zncc_parallel.c
+#define NEIBSIZE 256   // Size of the neighborhood for occlusion-filling
+#define MAX_THREADS 64 // Entries of the thread list
+#define MAX_SIZES 16   // Entries of the size list
+
+enum
+{
+    STAGE_RESIZE,
+    STAGE_MAPS,
+    STAGE_CC,
+    STAGE_FILL,
+    STAGE_NORM,
+    STAGE_TOTAL,
+    STAGES
+};
+
+static const char *StageNames[STAGES] = {"resize", "maps", "cross-check", "fill", "normalize", "total"};
+
+static const struct
+{
+    const char *name;
+    ZNCCEngine fn;
+} Engines[] = {
+    {"sat", CALCZNCC_SAT}, {"box", CALCZNCC_BOX}, {"simd", CALCZNCC_SIMD},
+    {"int", CALCZNCC_INT}, {"spec", CALCZNCC_SPEC}, {"tile", CALCZNCC_TILE},
+};
+
+typedef struct
+{
+    const uint8_t *imageL, *imageR; // RGBA pair at full resolution
+    uint32_t w, h;                  // Size of the part processed, h a multiple of 4
+    ZNCCEngine engine;
+    int32_t bsx, bsy, maxd;
+} BenchCase;
+
+static void RunOnce(const BenchCase *bc, double *t)
+{
+    /* One frame, the time of every stage into t */
+    uint32_t w = bc->w / 4, h = bc->h / 4;
+    int32_t halo = ZNCCKernelHalo(bc->bsx, bc->maxd);
+    PaddedImage imageL, imageR, checked;
+    uint8_t *lr, *rl, *out;
+    double start = omp_get_wtime(), t0;
+
+    AllocPaddedImage(&imageL, w, h, halo);
+    AllocPaddedImage(&imageR, w, h, halo);
+    AllocPaddedImage(&checked, w, h, NEIBSIZE / 2);
+
+    t0 = omp_get_wtime();
+    resizegray(bc->imageL, bc->imageR, &imageL, &imageR, bc->w, bc->h);
+    t[STAGE_RESIZE] = omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    lr = bc->engine(&imageL, &imageR, bc->bsx, bc->bsy, 0, bc->maxd);
+    rl = bc->engine(&imageR, &imageL, bc->bsx, bc->bsy, -bc->maxd, 0);
+    t[STAGE_MAPS] = omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    CrossCheck(lr, rl, &checked, bc->maxd, THRESHOLD);
+    t[STAGE_CC] = omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    out = OcclusionFill(&checked, NEIBSIZE);
+    t[STAGE_FILL] = omp_get_wtime() - t0;
+
+    t0 = omp_get_wtime();
+    normalize_dmap(out, w, h);
+    t[STAGE_NORM] = omp_get_wtime() - t0;
+    t[STAGE_TOTAL] = omp_get_wtime() - start;
+
+    FreePaddedImage(&imageL);
+    FreePaddedImage(&imageR);
+    FreePaddedImage(&checked);
+    free(lr);
+    free(rl);
+    free(out);
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void Measure(const BenchCase *bc, int32_t threads, int32_t warmup, int32_t reps, double *median, double *p95)
+{
+    /* Median and 95th percentile (nearest rank) of every stage over reps runs */
+    double *samples = (double *)malloc((size_t)reps * STAGES * sizeof(double));
+    double t[STAGES];
+    int32_t r, s;
+
+    omp_set_num_threads(threads);
+    for (r = 0; r < warmup; r++)
+        RunOnce(bc, t);
+    for (r = 0; r < reps; r++)
+    {
+        RunOnce(bc, t);
+        for (s = 0; s < STAGES; s++)
+            samples[s * reps + r] = t[s];
+    }
+    for (s = 0; s < STAGES; s++)
+    {
+        double *v = samples + s * reps;
+        qsort(v, reps, sizeof(double), CompareDoubles);
+        median[s] = reps % 2 ? v[reps / 2] : (v[reps / 2 - 1] + v[reps / 2]) / 2;
+        p95[s] = v[(95 * reps + 99) / 100 - 1];
+    }
+    free(samples);
+}
+
+static void WriteRows(FILE *csv, const char *scaling, const char *engine, const BenchCase *bc, int32_t threads, const double *median, const double *p95,
+                      const double *base)
+{
+    /* base: medians of the one-thread run of the same size (strong) or of the one-thread size (weak) */
+    int32_t s;
+
+    for (s = 0; s < STAGES; s++)
+    {
+        double speedup = strcmp(scaling, "strong") == 0 ? base[s] / median[s] : threads * base[s] / median[s];
+        fprintf(csv, "%s,%s,%u,%u,%d,%s,%.6f,%.6f,%.3f,%.3f\n", scaling, engine, bc->w / 4, bc->h / 4, threads, StageNames[s], median[s], p95[s],
+                speedup, speedup / threads);
+    }
+    fflush(csv);
+}
+
+static int32_t ParseList(const char *arg, double *values, int32_t max)
+{
+    /* Comma separated positive numbers; returns their count, 0 on a syntax error */
+    int32_t n = 0;
+    char *end;
+
+    while (*arg && n < max)
+    {
+        values[n] = strtod(arg, &end);
+        if (end == arg || values[n] <= 0)
+            return 0;
+        n++;
+        arg = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return 0;
+    }
+    return n;
+}
+
+static void Usage(const char *prog)
+{
+    printf("Usage: %s [-e engine] [-x bsx] [-y bsy] [-d maxdisp] [-n threads] [-s sizes] [-m mode] [-w warmup] [-r reps] [-o file] [left right]\n", prog);
+    printf("  -e engine   sat, box, simd (default), int, spec or tile (the library engines)\n");
+    printf("  -n threads  largest thread count (default: the processors); the counts are 1, 2, 4, ... and this one\n");
+    printf("  -s sizes    strong scaling sizes as fractions of the input height (default 0.25,0.5,1)\n");
+    printf("  -m mode     strong, weak or both (default)\n");
+    printf("  -w warmup   untimed runs per configuration (default 1)\n");
+    printf("  -r reps     timed runs per configuration (default 5)\n");
+    printf("  -o file     CSV output (default standard output)\n");
+}
+
+int32_t main(int32_t argc, char **argv)
+{
+    const char *left = "im0.png", *right = "im1.png", *engine_name = "simd", *mode = "both";
+    double sizes[MAX_SIZES] = {0.25, 0.5, 1};
+    int32_t nsizes = 3, maxthreads = omp_get_num_procs(), warmup = 1, reps = 5;
+    int32_t counts[MAX_THREADS], ncounts = 0;
+    double median[STAGES], p95[STAGES], base[STAGES];
+    uint8_t *imageL, *imageR;
+    uint32_t w1, h1, w2, h2, k;
+    FILE *csv = stdout;
+    BenchCase bc = {NULL, NULL, 0, 0, CALCZNCC_SIMD, 9, 9, 65};
+    int32_t opt, t, z;
+
+    while ((opt = getopt(argc, argv, "e:x:y:d:n:s:m:w:r:o:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            engine_name = optarg;
+            break;
+        case 'x':
+            bc.bsx = atoi(optarg);
+            break;
+        case 'y':
+            bc.bsy = atoi(optarg);
+            break;
+        case 'd':
+            bc.maxd = atoi(optarg);
+            break;
+        case 'n':
+            maxthreads = atoi(optarg);
+            break;
+        case 's':
+            nsizes = ParseList(optarg, sizes, MAX_SIZES);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'o':
+            csv = fopen(optarg, "w");
+            if (!csv)
+            {
+                printf("Cannot write %s\n", optarg);
+                return -1;
+            }
+            break;
+        default:
+            Usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (optind + 2 == argc)
+    {
+        left = argv[optind];
+        right = argv[optind + 1];
+    }
+
+    k = 0;
+    while (k < sizeof(Engines) / sizeof(Engines[0]) && strcmp(Engines[k].name, engine_name) != 0)
+        k++;
+    if (k == sizeof(Engines) / sizeof(Engines[0]) || nsizes == 0 || maxthreads < 1 || warmup < 0 || reps < 1 || bc.bsx < 2 || bc.bsy < 2 ||
+        bc.maxd < 0 || bc.maxd > UCHAR_MAX || (strcmp(mode, "strong") != 0 && strcmp(mode, "weak") != 0 && strcmp(mode, "both") != 0))
+    {
+        Usage(argv[0]);
+        return -1;
+    }
+    bc.engine = Engines[k].fn;
+
+    if (lodepng_decode32_file(&imageL, &w1, &h1, left) || lodepng_decode32_file(&imageR, &w2, &h2, right) || w1 != w2 || h1 != h2)
+    {
+        printf("Cannot read a pair of images of the same size from %s and %s\n", left, right);
+        return -1;
+    }
+    bc.imageL = imageL;
+    bc.imageR = imageR;
+    bc.w = w1 / 4 * 4;
+    // A disparity of the image width or more leaves no window inside both images
+    if (bc.maxd >= (int32_t)(bc.w / 4))
+    {
+        printf("The maximum disparity must be smaller than the width of the resized image (%u)\n", bc.w / 4);
+        return -1;
+    }
+
+    for (t = 1; t < maxthreads && ncounts < MAX_THREADS - 1; t *= 2)
+        counts[ncounts++] = t;
+    counts[ncounts++] = maxthreads;
+
+    fprintf(csv, "scaling,engine,width,height,threads,stage,median_s,p95_s,speedup,efficiency\n");
+
+    if (strcmp(mode, "weak") != 0)
+    {
+        for (z = 0; z < nsizes; z++)
+        {
+            bc.h = (uint32_t)(h1 * (sizes[z] < 1 ? sizes[z] : 1)) / 4 * 4;
+            if (bc.h < 4)
+                continue;
+            for (t = 0; t < ncounts; t++)
+            {
+                fprintf(stderr, "strong %ux%u, %d threads\n", bc.w / 4, bc.h / 4, counts[t]);
+                Measure(&bc, counts[t], warmup, reps, median, p95);
+                if (t == 0)
+                    memcpy(base, median, sizeof(base));
+                WriteRows(csv, "strong", engine_name, &bc, counts[t], median, p95, base);
+            }
+        }
+    }
+
+    if (strcmp(mode, "strong") != 0)
+    {
+        for (t = 0; t < ncounts; t++)
+        {
+            bc.h = (uint32_t)((uint64_t)h1 * counts[t] / maxthreads) / 4 * 4;
+            if (bc.h < 4)
+                bc.h = 4;
+            fprintf(stderr, "weak %ux%u, %d threads\n", bc.w / 4, bc.h / 4, counts[t]);
+            Measure(&bc, counts[t], warmup, reps, median, p95);
+            if (t == 0)
+                memcpy(base, median, sizeof(base));
+            WriteRows(csv, "weak", engine_name, &bc, counts[t], median, p95, base);
+        }
+    }
+
+    if (csv != stdout)
+        fclose(csv);
+    free(imageL);
+    free(imageR);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef STEREO_H
+#define STEREO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The Phase 4 pipeline as a library for streams of frames: resize, simd LR and RL
+ * maps, cross-check, occlusion fill and normalization. A context is built once for
+ * a frame size and parameter set and owns every intermediate map in one arena, so
+ * StereoCompute allocates nothing and runs each frame as a single parallel region
+ * of a fixed team of threads.
+ */
+typedef struct
+{
+    int32_t bsx, bsy;   // Window size
+    int32_t maxd;       // Maximum disparity on the downscaled images, up to 255 and below their width
+    uint32_t threshold; // Cross-check tolerance
+    uint32_t nsize;     // Neighbourhood of the occlusion fill
+    int32_t threads;    // Team size, 0 for the OpenMP default
+} StereoParams;
+
+typedef struct StereoContext StereoContext;
+
+// Context for pairs of w x h RGBA images, whose maps are w / 4 x h / 4; NULL on invalid parameters or out of memory
+StereoContext *StereoCreate(uint32_t w, uint32_t h, const StereoParams *params);
+// Normalized disparity map of the RGBA pair into out, w / 4 x h / 4 bytes
+void StereoCompute(StereoContext *ctx, const uint8_t *left, const uint8_t *right, uint8_t *out);
+// Raw LR and RL maps of the last frame, owned by the context and overwritten by the next StereoCompute
+void StereoMaps(const StereoContext *ctx, const uint8_t **lr, const uint8_t **rl);
+void StereoDestroy(StereoContext *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
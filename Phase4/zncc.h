@@ -0,0 +1,429 @@
+#ifndef ZNCC_H
+#define ZNCC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define IMAGE_ALIGN 64 // Alignment of the rows of padded images, in bytes
+
+typedef enum
+{
+    HALO_ZERO, // Sentinel zeros: no disparity in maps, no contribution to ZNCC cross terms
+} HaloMode;
+
+/*
+ * Grayscale image or map with a border of halo pixels on every side. Rows of the
+ * interior start on IMAGE_ALIGN boundaries, so kernels can read up to halo pixels
+ * past any edge without bounds checks and vector loads stay legal at the edges.
+ */
+typedef struct
+{
+    uint8_t *buf;    // Allocation
+    uint8_t *data;   // First pixel of the interior
+    uint32_t w, h;   // Size of the interior
+    uint32_t stride; // Distance between rows in bytes, a multiple of IMAGE_ALIGN
+    uint32_t halo;   // Border pixels available on every side
+    HaloMode mode;   // Contents of the border
+} PaddedImage;
+
+// Allocates a zeroed image (HALO_ZERO); returns false when out of memory
+bool AllocPaddedImage(PaddedImage *img, uint32_t w, uint32_t h, uint32_t halo);
+// Bytes of the buffer of a padded image, for callers carving images out of their own memory
+size_t PaddedImageBytes(uint32_t w, uint32_t h, uint32_t halo);
+// Zeroed image in buf (IMAGE_ALIGN aligned, PaddedImageBytes long), which stays owned by the caller
+void PlacePaddedImage(PaddedImage *img, uint8_t *buf, uint32_t w, uint32_t h, uint32_t halo);
+void FreePaddedImage(PaddedImage *img);
+// Malloc'ed contiguous w x h copy of the interior
+uint8_t *PackImage(const PaddedImage *img);
+
+/*
+ * NUMA placement (zncc_numa.c). AllocPaddedImage always first-touches the interior
+ * rows with the static row split of the engines; the rest is enabled from the
+ * command line. Without NUMA support everything behaves as a single node.
+ */
+typedef struct
+{
+    bool enabled;         // Node of every thread recorded, placement report printed
+    bool replicate;       // Copies of the input images on every node, read through NumaLocal
+    const char *affinity; // CPU list ("0-3,8") thread k is pinned to the k-th entry of, NULL for no pinning
+} NumaConfig;
+
+extern NumaConfig Numa;
+
+// Pins the OpenMP threads following Numa.affinity and records their nodes; false on an invalid map
+bool NumaSetup(void);
+// Copies img to every node running a thread; false when out of memory or replica slots
+bool NumaReplicate(const PaddedImage *img);
+// The copy of img on the node of the calling thread, img when it is not replicated
+const PaddedImage *NumaLocal(const PaddedImage *img);
+// Prints the share of the pages of the h rows at data (stride apart) local to the threads that own them
+void NumaReport(const char *name, const uint8_t *data, uint32_t stride, uint32_t h);
+void NumaRelease(void);
+
+/*
+ * Signature shared by all disparity engines: returns a malloc'ed w x h map of |best d|.
+ * The left and right images have the same size and halo.
+ */
+typedef uint8_t *(*ZNCCEngine)(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+
+// Integral images (summed-area tables) of a grayscale image
+typedef struct
+{
+    uint32_t w, h;  // Size of the source image
+    uint32_t stride; // Row length of the tables (w + 1)
+    int64_t *sum;   // (h + 1) x (w + 1) table of pixel sums
+    int64_t *sqsum; // (h + 1) x (w + 1) table of squared pixel sums
+} IntegralImage;
+
+void BuildIntegralImage(IntegralImage *ii, const PaddedImage *image);
+// The two passes of BuildIntegralImage, for tables allocated by the caller with a zero first row
+void IntegralRows(IntegralImage *ii, const PaddedImage *image, int32_t i0, int32_t i1);
+void IntegralColumns(IntegralImage *ii, int32_t c0, int32_t c1);
+void FreeIntegralImage(IntegralImage *ii);
+
+// Sum of the table over rows [r0, r1) and columns [c0, c1)
+static inline int64_t RectSum(const int64_t *table, uint32_t stride, int32_t r0, int32_t r1, int32_t c0, int32_t c1)
+{
+    return table[r1 * stride + c1] - table[r0 * stride + c1] - table[r1 * stride + c0] + table[r0 * stride + c0];
+}
+
+/*
+ * ZNCC of a window from its integer sums, with the same convention as CALCZNCC:
+ * the means are divided by the nominal block size bsize while only the n valid taps
+ * are accumulated. Everything is scaled by bsize^2 so the statistics stay exact.
+ * Returns -1 (never selected) when one of the windows has no variance.
+ */
+static inline double ZNCCFromSums(int64_t n, int64_t bsize, int64_t sl, int64_t sr, int64_t sll, int64_t srr, int64_t slr)
+{
+    int64_t num = bsize * bsize * slr - 2 * bsize * sl * sr + n * sl * sr;
+    int64_t lvar = bsize * bsize * sll - 2 * bsize * sl * sl + n * sl * sl;
+    int64_t rvar = bsize * bsize * srr - 2 * bsize * sr * sr + n * sr * sr;
+
+    if (lvar <= 0 || rvar <= 0)
+        return -1;
+    return num / (sqrt((double)lvar) * sqrt((double)rvar));
+}
+
+/*
+ * Exact integer form of the same score: ZNCC = num / sqrt(lvar * rvar) with the
+ * terms of ZNCCFromSums. Two scores are ordered by cross-multiplying the squared
+ * numerators with the other denominator, taking the signs into account, so the
+ * winner-take-all needs neither sqrt nor division.
+ */
+typedef struct
+{
+    int64_t num;  // Numerator, carries the sign of the score
+    int64_t lvar; // Left window variance term (> 0 for a valid score)
+    int64_t rvar; // Right window variance term (> 0 for a valid score)
+} ZNCCTerms;
+
+// Initial best score of CALCZNCC (-1): ties with it are never selected
+static const ZNCCTerms ZNCCTermsMinusOne = {-1, 1, 1};
+
+static inline ZNCCTerms ZNCCTermsFromSums(int64_t n, int64_t bsize, int64_t sl, int64_t sr, int64_t sll, int64_t srr, int64_t slr)
+{
+    ZNCCTerms t;
+    t.num = bsize * bsize * slr - 2 * bsize * sl * sr + n * sl * sr;
+    t.lvar = bsize * bsize * sll - 2 * bsize * sl * sl + n * sl * sl;
+    t.rvar = bsize * bsize * srr - 2 * bsize * sr * sr + n * sr * sr;
+    return t;
+}
+
+// a * b compared with c * d for 128-bit unsigned operands, through 256-bit products
+static inline int32_t CompareProducts128(unsigned __int128 a, unsigned __int128 b, unsigned __int128 c, unsigned __int128 d)
+{
+    unsigned __int128 hi[2], lo[2], x[2] = {a, c}, y[2] = {b, d};
+    int32_t k;
+
+    for (k = 0; k < 2; k++)
+    {
+        uint64_t x0 = (uint64_t)x[k], x1 = (uint64_t)(x[k] >> 64);
+        uint64_t y0 = (uint64_t)y[k], y1 = (uint64_t)(y[k] >> 64);
+        unsigned __int128 p00 = (unsigned __int128)x0 * y0;
+        unsigned __int128 p01 = (unsigned __int128)x0 * y1;
+        unsigned __int128 p10 = (unsigned __int128)x1 * y0;
+        unsigned __int128 mid = (p00 >> 64) + (uint64_t)p01 + (uint64_t)p10;
+        lo[k] = (mid << 64) | (uint64_t)p00;
+        hi[k] = (unsigned __int128)x1 * y1 + (p01 >> 64) + (p10 >> 64) + (mid >> 64);
+    }
+    if (hi[0] != hi[1])
+        return hi[0] > hi[1] ? 1 : -1;
+    if (lo[0] != lo[1])
+        return lo[0] > lo[1] ? 1 : -1;
+    return 0;
+}
+
+/*
+ * True when score a is strictly greater than score b. When both share the left
+ * variance (the usual case: the left window does not change with d) and
+ * small_terms is set by the caller (num^2 * var fits in 128 bits), the check is a
+ * single 128-bit cross-multiplication.
+ */
+static inline bool ZNCCGreater(const ZNCCTerms *a, const ZNCCTerms *b, bool small_terms)
+{
+    unsigned __int128 na2, nb2;
+    int32_t cmp;
+
+    if ((a->num >= 0) != (b->num >= 0))
+        return a->num >= 0;
+
+    na2 = (unsigned __int128)((__int128)a->num * a->num);
+    nb2 = (unsigned __int128)((__int128)b->num * b->num);
+    if (small_terms && a->lvar == b->lvar)
+    {
+        unsigned __int128 lhs = na2 * (uint64_t)b->rvar, rhs = nb2 * (uint64_t)a->rvar;
+        cmp = lhs > rhs ? 1 : (lhs < rhs ? -1 : 0);
+    }
+    else
+    {
+        cmp = CompareProducts128(na2, (unsigned __int128)b->lvar * (uint64_t)b->rvar, nb2, (unsigned __int128)a->lvar * (uint64_t)a->rvar);
+    }
+    // |a| > |b| wins for positive scores, loses for negative ones
+    return a->num >= 0 ? cmp > 0 : cmp < 0;
+}
+
+typedef enum
+{
+    SCHED_STATIC, // omp parallel for over rows, static schedule
+    SCHED_STEAL,  // 2D tiles on per-worker deques with work stealing and adaptive splitting
+} SchedKind;
+
+typedef struct
+{
+    SchedKind kind;
+    int32_t tile; // Initial tile size of SCHED_STEAL, in pixels
+} SchedConfig;
+
+extern SchedConfig Sched; // Used by RunTiles, set from the command line
+
+// Work item of RunTiles: pixels of rows [r0, r1) x columns [c0, c1)
+typedef void (*TileFn)(void *arg, int32_t r0, int32_t r1, int32_t c0, int32_t c1);
+
+typedef struct
+{
+    double busy;    // Seconds spent running tiles
+    int32_t tiles;  // Tiles run
+    int32_t stolen; // Tiles taken from another worker's deque
+    int32_t splits; // Tiles split because they were expected to run too long
+} WorkerStats;
+
+// Runs fn over a w x h image with the scheduler selected in Sched
+void RunTiles(uint32_t w, uint32_t h, TileFn fn, void *arg);
+// Prints the busy and idle time of every worker, accumulated over all RunTiles calls
+void SchedReport(void);
+// Forgets the accumulated busy and idle times, e.g. of the autotuner's passes
+void SchedResetStats(void);
+
+uint8_t *CALCZNCC(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+uint8_t *CALCZNCC_SAT(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+uint8_t *CALCZNCC_BOX(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+uint8_t *CALCZNCC_SIMD(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+uint8_t *CALCZNCC_INT(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+uint8_t *CALCZNCC_SPEC(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+// Randomized search (random init, neighbour propagation, random refinement), cost nearly independent of the range
+uint8_t *CALCZNCC_PATCHMATCH(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+// Top rows on an OpenCL device (with -DZNCC_OPENCL), the others on the host, split by the throughput of the previous calls
+uint8_t *CALCZNCC_HYBRID(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+// Rows and time of each side for every CALCZNCC_HYBRID call, with the device share that followed
+void HybridReport(void);
+
+// True when CALCZNCC_SPEC has a compiled instantiation for this window and disparity range
+bool ZNCCSpecAvailable(int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+
+// Block sizes of CALCZNCC_TILE
+typedef struct
+{
+    int32_t cols;  // Columns per tile
+    int32_t rows;  // Rows per band
+    int32_t chunk; // Disparities per chunk
+} TileConfig;
+
+uint8_t *CALCZNCC_TILE(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+// Times a few block sizes on the images once per run and keeps the fastest for CALCZNCC_TILE
+void ZNCCTileProbe(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd);
+TileConfig ZNCCTileConfig(void);
+// Fixes the block sizes of CALCZNCC_TILE, skipping the probe
+void ZNCCSetTileConfig(TileConfig cfg);
+
+typedef enum
+{
+    LOOP_STATIC,
+    LOOP_DYNAMIC,
+    LOOP_GUIDED,
+} LoopKind;
+
+typedef struct
+{
+    LoopKind kind;
+    int32_t chunk; // Rows per chunk, 0 for the default of the kind
+} LoopSchedule;
+
+extern LoopSchedule RowLoop; // Schedule of the row loop of CALCZNCC_SIMD, static by default
+
+// Sets the OpenMP runtime schedule, used by the loops declared schedule(runtime)
+void SetLoopSchedule(const LoopSchedule *s);
+
+/*
+ * Autotuner (zncc_tune.c): thread count of the selected engine, then the knobs it
+ * has: the tile scheduler of naive (Sched), the row schedule of simd (RowLoop) or
+ * the block sizes of tile (TileConfig). Results are kept per host, image size,
+ * window, disparity range and engine in a cache file ($ZNCC_TUNE_CACHE,
+ * ~/.zncc_tune by default).
+ */
+typedef struct
+{
+    uint32_t w, h;
+    int32_t bsx, bsy, maxd;
+    const char *engine; // Name of the engine, as given to -e
+} TuneKey;
+
+typedef struct
+{
+    int32_t threads;
+    SchedConfig sched;
+    LoopSchedule rows;
+    TileConfig tiles;
+} TuneResult;
+
+// Times the candidates of engine on the pair, one LR pass each, and returns the fastest
+TuneResult Autotune(const TuneKey *key, ZNCCEngine engine, const PaddedImage *left, const PaddedImage *right);
+// Entry of this host for key; false when there is none
+bool TuneLoad(const TuneKey *key, TuneResult *res);
+// Adds or replaces the entry of this host for key
+bool TuneSave(const TuneKey *key, const TuneResult *res);
+void TuneApply(const TuneResult *res);
+// "threads=8 schedule=dynamic,4 sched=steal,64 tile=64x8x32", the form used in the cache file
+void TuneFormat(const TuneResult *res, char *buf, size_t size);
+
+#define PYRAMID_MAX_LEVELS 8 // Levels of CALCZNCC_PYRAMID, including the input
+
+// 2x2 box average of src into dst, allocated with half the size of src
+void DownsampleImage(const PaddedImage *src, PaddedImage *dst);
+// Map of |d| searching +/- radius around twice the coarse map (cw x ch, half the size), sign +1 for LR, -1 for RL
+uint8_t *CALCZNCC_REFINE(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, const uint8_t *coarse, uint32_t cw, uint32_t ch, int32_t sign, int32_t radius, int32_t maxd);
+// Coarse-to-fine LR and RL maps at full size; maxd is the range at the coarsest level, engine NULL means CALCZNCC_FUSED
+bool CALCZNCC_PYRAMID(const PaddedImage *left, const PaddedImage *right, int32_t levels, ZNCCEngine engine, int32_t bsx, int32_t bsy, int32_t maxd, int32_t radius, uint8_t **dmapLR, uint8_t **dmapRL);
+
+// Both LR ([mind, maxd]) and RL ([-maxd, -mind]) maps from one sweep over the correlations
+void CALCZNCC_FUSED(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, uint8_t **dmapLR, uint8_t **dmapRL);
+
+#define SHARD_MAX_WORKERS 256 // Worker processes of the multi-process mode
+
+// LR and RL maps from worker processes of prog (started with -W) over bands of rows, the images shared through POSIX shared memory
+bool ShardMaps(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t maxd, int32_t workers, const char *prog,
+               uint8_t **dmapLR, uint8_t **dmapRL);
+// Body of a worker process, spec as passed by ShardMaps; returns the exit status
+int32_t ShardWorker(const char *spec);
+
+/*
+ * Stages of the pipeline around the engines (zncc_stages.c). Maps are contiguous
+ * w x h arrays unless they are PaddedImages; images come from lodepng as RGBA.
+ */
+// Row i of both images downscaled by 4 and converted to grayscale, from RGBA originals of width w
+void resizegray_row(const uint8_t *imageL, const uint8_t *imageR, uint8_t *rowL, uint8_t *rowR, uint32_t w, int32_t i);
+void resizegray(const uint8_t *imageL, const uint8_t *imageR, PaddedImage *resizedL, PaddedImage *resizedR, uint32_t w, uint32_t h);
+void grayscale(const uint8_t *imageL, const uint8_t *imageR, PaddedImage *grayL, PaddedImage *grayR);
+// Maps [min, max] linearly onto [0, 255]
+void rescale_dmap(uint8_t *arr, int32_t imsize, uint8_t min, uint8_t max);
+void normalize_dmap(uint8_t *arr, uint32_t w, uint32_t h);
+// One row of the cross-check: row1[j] where it agrees with row2[j] within threshold, 0 elsewhere
+void CrossCheckRow(const uint8_t *row1, const uint8_t *row2, uint8_t *row, uint32_t w, uint32_t threshold);
+void CrossCheckRows(const uint8_t *map1, const uint8_t *map2, PaddedImage *map, uint32_t threshold, int32_t r0, int32_t r1);
+// Writes the interior of map, whose halo stays zero
+void CrossCheck(const uint8_t *map1, const uint8_t *map2, PaddedImage *map, uint32_t dmax, uint32_t threshold);
+// Nearest non-zero value around column j of rows[0] within nsize / 2; rows[i_b] must exist for i_b in [ib0, ib1]
+uint8_t FillPixel(const uint8_t *const *rows, int32_t j, int32_t ib0, int32_t ib1, uint32_t nsize);
+typedef enum
+{
+    FILL_SEARCH, // FillPixel on every occluded pixel, squares of growing size
+    FILL_SWEEP,  // Nearest valid pixel (chessboard distance) from a two-phase distance transform, ties broken by the sweeps
+    FILL_RING,   // Same distance transform, ties broken like FillPixel: same result as FILL_SEARCH in linear time
+} FillMode;
+
+extern FillMode Fill; // Algorithm of OcclusionFill, set from the command line
+
+// Malloc'ed filled copy of map, which needs a zero halo of nsize / 2 for FILL_SEARCH; NULL otherwise
+uint8_t *OcclusionFill(const PaddedImage *map, uint32_t nsize);
+#define FILL_MAX_SIZE 65535 // Largest side of the maps of the linear-time fill, whose tables are 16-bit
+// FILL_SWEEP or, with ring, FILL_RING fill of map in O(w * h) (zncc_fill.c); NULL when map is larger than FILL_MAX_SIZE
+uint8_t *OcclusionFillSweep(const PaddedImage *map, uint32_t nsize, bool ring);
+// Bytes of the scratch PostProcess needs for w x h maps, which can be reused from frame to frame
+size_t PostProcessScratch(uint32_t w, uint32_t h);
+// Cross-check, fill (FILL_SWEEP, FILL_RING otherwise) and normalization of the w x h LR and RL maps into out, with sides up to FILL_MAX_SIZE; scratch NULL to allocate it
+void PostProcess(const uint8_t *lr, const uint8_t *rl, uint32_t w, uint32_t h, uint32_t threshold, uint32_t nsize, void *scratch, uint8_t *out);
+#define MEDIAN_MAX_RADIUS 127 // Largest radius of MedianFilter, whose window counts are 16-bit
+
+// Malloc'ed median of the w x h map over (2 radius + 1)^2 windows, borders replicated; NULL for an unsupported radius (zncc_median.c)
+uint8_t *MedianFilter(const uint8_t *map, uint32_t w, uint32_t h, int32_t radius);
+
+/*
+ * Cross-term kernels. Each call returns, for `lanes` adjacent pixels starting at
+ * column x0 + taps / 2, the sum over rows [r0, r1) of L(r, x) * R(r, x - d) across
+ * the taps columns of their windows. The window has an even number of taps, so
+ * neighbouring taps are paired and multiplied with a 16-bit multiply-add: one madd
+ * covers 8 (SSE4.1), 16 (AVX2) or 32 (AVX-512) pixel-tap products.
+ * Rows of both images are stride bytes apart. The caller guarantees that all the
+ * columns read lie inside both images or their halos.
+ */
+typedef void (*CrossTermKernel)(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t x0, int32_t taps, int32_t d, int32_t *slr);
+
+// Name of the vector kernel the SIMD engines run on this CPU (avx512, avx2, sse4.1 or generic)
+const char *ZNCCSimdVariant(void);
+// The selected kernel and the number of pixels it scores per call
+CrossTermKernel SelectCrossTermKernel(int32_t *lanes);
+// data[k] = lut[data[k]] for n bytes, with byte shuffles of the selected instruction set
+void RemapBytes(const uint8_t *lut, uint8_t *data, size_t n);
+// Cross term of one pixel over the clipped window rows [r0, r1) and columns [c0, c1), for the borders
+int64_t CrossTermClipped(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t c0, int32_t c1, int32_t d);
+
+/*
+ * Halo the kernels need to run unclipped on every pixel for disparities up to maxd
+ * in magnitude: the window half-width, the shift and one block of the widest kernel.
+ * Zero halos of that size contribute nothing to the cross term, so the kernel result
+ * equals the clipped sum.
+ */
+static inline uint32_t ZNCCKernelHalo(int32_t bsx, int32_t maxd)
+{
+    return bsx / 2 + abs(maxd) + 16 + 1;
+}
+
+// True when both images have zero halos of at least ZNCCKernelHalo for [mind, maxd]
+bool ZeroHaloCovers(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t mind, int32_t maxd);
+
+/*
+ * Optional outputs of the simd engine, laid out like dmap and filled in the same
+ * sweep over the disparities. The confidence of a pixel is 127.5 times the score
+ * of the winner minus the best score more than one disparity away from it (the
+ * second peak), -1 standing for a missing second peak: 0 for a pixel without any
+ * score above -1, 255 for a lone perfect peak. The sub-pixel disparity fits a
+ * parabola to the scores at the winner and its two neighbours and moves the
+ * winner to its vertex, by at most half a disparity; it stays on the winner when
+ * a neighbour is out of the range or the scores are not concave there.
+ */
+#define SUBPIXEL_SCALE 16 // Steps per pixel of the sub-pixel map
+
+typedef struct
+{
+    uint8_t *confidence; // NULL when not wanted
+    uint16_t *subpixel;  // |disparity| in 1/SUBPIXEL_SCALE pixel, NULL when not wanted
+} ZNCCExtra;
+
+typedef struct PeakState PeakState; // Scores around the winner of one pixel, for the maps of ZNCCExtra (zncc_simd.c)
+
+/*
+ * Rows [i0, i1) of CALCZNCC_SIMD written to the w-wide dmap, with best_score and
+ * best_d as w-entry scratch. Row 0 of left, right, iil and iir is image row row0
+ * and h is the height of the whole image, so band buffers can be passed. extra,
+ * NULL for none, receives the same rows of its maps, with peaks as w-entry scratch.
+ */
+void ZNCCSimdRows(const PaddedImage *left, const PaddedImage *right, const IntegralImage *iil, const IntegralImage *iir, int32_t row0, int32_t h,
+                  int32_t i0, int32_t i1, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, double *best_score, int32_t *best_d, uint8_t *dmap,
+                  const ZNCCExtra *extra, PeakState *peaks);
+// CALCZNCC_SIMD filling the maps of extra as well
+uint8_t *CALCZNCC_SIMD_EXTRA(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, const ZNCCExtra *extra);
+
+#endif
@@ -0,0 +1,145 @@
+#include "zncc.h"
+
+#define BOX_BAND 64 // Rows per work item of the sliding engine
+
+uint8_t *CALCZNCC_BOX(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /*
+     * Disparity map computation one disparity plane at a time: the product image
+     * L(x) * R(x - d) is box-filtered with running column sums (slid down the rows)
+     * and a prefix sum along the row, so every (pixel, d) costs O(1) whatever the
+     * window size. Window means and variances come from the integral images.
+     */
+    uint32_t w = left->w, h = left->h; // Size of the image
+    uint32_t stride = left->stride;    // Row pitch of both images
+    const uint8_t *ldata = left->data, *rdata = right->data;
+    int32_t imsize = w * h;
+    int32_t bsize = bsx * bsy; // Block size
+    int32_t nbands = (h + BOX_BAND - 1) / BOX_BAND;
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel shared(ldata, rdata, dmap, iil, iir)
+    {
+        // Per-thread scratch: running column sums, their prefix along the row and the band's winners
+        int32_t *colsum = (int32_t *)malloc(w * sizeof(int32_t));
+        int64_t *prefix = (int64_t *)malloc((w + 1) * sizeof(int64_t));
+        double *best_score = (double *)malloc(BOX_BAND * w * sizeof(double));
+        int32_t *best_d = (int32_t *)malloc(BOX_BAND * w * sizeof(int32_t));
+        int32_t band;
+
+        #pragma omp for schedule(dynamic)
+        for (band = 0; band < nbands; band++)
+        {
+            int32_t b0 = band * BOX_BAND;                           // First row of the band
+            int32_t b1 = b0 + BOX_BAND < h ? b0 + BOX_BAND : h;     // One past the last row of the band
+            int32_t i, j, r, c, d;
+            int32_t r0, r1; // Rows of the window clipped to the image, [r0, r1)
+            int32_t c0, c1; // Columns of the left window clipped to both images, [c0, c1)
+            int32_t v0, v1; // Columns where the product image is defined, [v0, v1)
+            int64_t n, sl, sr, sll, srr, slr;
+            double current_score;
+
+            for (i = 0; i < (b1 - b0) * w; i++)
+            {
+                best_score[i] = -1;
+                best_d[i] = maxd;
+            }
+
+            for (d = mind; d <= maxd; d++)
+            {
+                v0 = d > 0 ? d : 0;
+                v1 = d < 0 ? w + d : w;
+
+                // Column sums of the product image over the window of the first row of the band
+                for (c = 0; c < w; c++)
+                    colsum[c] = 0;
+                r0 = b0 - bsy / 2 > 0 ? b0 - bsy / 2 : 0;
+                r1 = b0 + bsy / 2 < h ? b0 + bsy / 2 : h;
+                for (r = r0; r < r1; r++)
+                {
+                    const uint8_t *lrow = ldata + r * stride;
+                    const uint8_t *rrow = rdata + r * stride - d;
+                    for (c = v0; c < v1; c++)
+                        colsum[c] += lrow[c] * rrow[c];
+                }
+
+                for (i = b0; i < b1; i++)
+                {
+                    r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+                    r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+
+                    // Sliding the column sums one row down: drop row i - 1 - bsy / 2, add row i - 1 + bsy / 2
+                    if (i > b0)
+                    {
+                        r = i - 1 - bsy / 2;
+                        if (r >= 0)
+                        {
+                            const uint8_t *lrow = ldata + r * stride;
+                            const uint8_t *rrow = rdata + r * stride - d;
+                            for (c = v0; c < v1; c++)
+                                colsum[c] -= lrow[c] * rrow[c];
+                        }
+                        r = i - 1 + bsy / 2;
+                        if (r < h)
+                        {
+                            const uint8_t *lrow = ldata + r * stride;
+                            const uint8_t *rrow = rdata + r * stride - d;
+                            for (c = v0; c < v1; c++)
+                                colsum[c] += lrow[c] * rrow[c];
+                        }
+                    }
+
+                    prefix[0] = 0;
+                    for (c = 0; c < w; c++)
+                        prefix[c + 1] = prefix[c] + colsum[c];
+
+                    for (j = 0; j < w; j++)
+                    {
+                        // Same taps as the border checks of CALCZNCC
+                        c0 = j - bsx / 2;
+                        if (c0 < v0)
+                            c0 = v0;
+                        c1 = j + bsx / 2;
+                        if (c1 > v1)
+                            c1 = v1;
+                        if (c1 <= c0 || r1 <= r0)
+                            continue;
+
+                        n = (int64_t)(r1 - r0) * (c1 - c0);
+                        sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                        sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                        sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                        srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+                        slr = prefix[c1] - prefix[c0];
+
+                        current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                        // Selecting the best disparity, d increases so ties keep the smallest d as in CALCZNCC
+                        if (current_score > best_score[(i - b0) * w + j])
+                        {
+                            best_score[(i - b0) * w + j] = current_score;
+                            best_d[(i - b0) * w + j] = d;
+                        }
+                    }
+                }
+            }
+
+            for (i = 0; i < (b1 - b0) * w; i++)
+                dmap[b0 * w + i] = (uint8_t)abs(best_d[i]); // Considering both Left to Right and Right to left disparities
+        }
+
+        free(colsum);
+        free(prefix);
+        free(best_score);
+        free(best_d);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
@@ -0,0 +1,284 @@
+#include <omp.h>
+#include <string.h>
+#include "zncc.h"
+
+/*
+ * Occlusion fill in linear time. The chessboard (Chebyshev) distance from every
+ * pixel to the nearest non-zero one is computed exactly with the two phases of the
+ * Meijster-Roerdink-Hesselink distance transform: a downward and an upward sweep of
+ * every column give the vertical distance g to the nearest valid pixel of the
+ * column, then a forward and a backward sweep of every row take the lower envelope
+ * of max(|j - x|, g(x)) over the columns x. The columns and then the rows are
+ * independent, so both phases run in parallel, and the cost no longer depends on
+ * the size of the holes.
+ *
+ * FILL_SWEEP takes the value of the pixel the envelope points at. FILL_RING gives
+ * the result of FillPixel: at distance D its square search meets the left column
+ * of the ring first (topmost pixel), then the top and bottom rows column by column
+ * (top first), then the right column, the inside of the ring holding no valid
+ * pixel. Tables of the next valid pixel below and to the right of every position
+ * find that pixel in O(1).
+ *
+ * PostProcess reads the LR and RL maps once into a byte plane holding the value of
+ * every pixel where they agree within the threshold and 0 elsewhere, which every
+ * later sweep tests instead of the two maps. The tables hold 16-bit row and column
+ * indices, so the scratch is 7 bytes per pixel. The row phase writes the final
+ * values and their min/max, and the normalization is a 256-entry table applied by
+ * RemapBytes.
+ */
+
+#define FILL_COLUMNS 64 // Columns per work item of the column sweeps
+
+FillMode Fill = FILL_RING;
+
+#define FILL_NONE UINT16_MAX // Row of the nearest valid pixel of an empty column
+
+typedef struct
+{
+    const uint8_t *v; // Value of the valid pixels, 0 on the others
+    uint32_t stride;
+    int32_t w, h;
+} FillSource;
+
+static inline bool Valid(const FillSource *src, int32_t i, int32_t x)
+{
+    return src->v[(size_t)i * src->stride + x] != 0;
+}
+
+static void ColumnSweeps(const FillSource *src, uint16_t *nearest, uint16_t *below)
+{
+    /*
+     * nearest: row of the nearest valid pixel of the column (the upper one on ties),
+     * FILL_NONE when the column is empty; below: first valid row at or below, h when none.
+     */
+    int32_t w = src->w, h = src->h;
+    int32_t c0;
+
+    #pragma omp parallel for schedule(static)
+    for (c0 = 0; c0 < w; c0 += FILL_COLUMNS)
+    {
+        int32_t c1 = c0 + FILL_COLUMNS < w ? c0 + FILL_COLUMNS : w;
+        int32_t i, x;
+
+        // Downward: last valid row at or above, in nearest
+        for (x = c0; x < c1; x++)
+            nearest[x] = Valid(src, 0, x) ? 0 : FILL_NONE;
+        for (i = 1; i < h; i++)
+        {
+            for (x = c0; x < c1; x++)
+                nearest[i * w + x] = Valid(src, i, x) ? i : nearest[(i - 1) * w + x];
+        }
+
+        // Upward: first valid row at or below, then the nearer of the two
+        for (x = c0; x < c1; x++)
+            below[(h - 1) * w + x] = Valid(src, h - 1, x) ? h - 1 : h;
+        for (i = h - 2; i >= 0; i--)
+        {
+            for (x = c0; x < c1; x++)
+                below[i * w + x] = Valid(src, i, x) ? i : below[(i + 1) * w + x];
+        }
+        for (i = 0; i < h; i++)
+        {
+            for (x = c0; x < c1; x++)
+            {
+                int32_t up = nearest[i * w + x], down = below[i * w + x];
+                if (down < h && (up == FILL_NONE || down - i < i - up))
+                    nearest[i * w + x] = down;
+            }
+        }
+    }
+}
+
+static inline int32_t Chessboard(int32_t j, int32_t x, int32_t g)
+{
+    return abs(j - x) > g ? abs(j - x) : g;
+}
+
+static inline int32_t Sep(int32_t x, int32_t u, int32_t gx, int32_t gu)
+{
+    /* First column from which u is at least as close as x < u (Meijster et al., chessboard metric) */
+    if (gx <= gu)
+        return x + gu > (x + u) / 2 ? x + gu : (x + u) / 2;
+    return u - gx < (x + u) / 2 ? u - gx : (x + u) / 2;
+}
+
+static uint8_t RingPixel(const FillSource *src, const uint16_t *below, const uint16_t *right, int32_t i, int32_t j, int32_t d)
+{
+    /* First valid pixel of the ring at distance d in the order of FillPixel */
+    int32_t w = src->w, h = src->h;
+    int32_t lo = i - d > 0 ? i - d : 0, hi = i + d < h - 1 ? i + d : h - 1;
+    int32_t x0 = j - d + 1 > 0 ? j - d + 1 : 0, x1 = j + d - 1 < w - 1 ? j + d - 1 : w - 1;
+    int32_t r, x = w, row = 0;
+
+    // Left column, topmost pixel
+    if (j - d >= 0 && (r = below[lo * w + j - d]) <= hi)
+        return src->v[(size_t)r * src->stride + j - d];
+    // Top and bottom rows, leftmost column, the top row first
+    if (x0 <= x1)
+    {
+        if (i - d >= 0 && right[(i - d) * w + x0] <= x1)
+        {
+            x = right[(i - d) * w + x0];
+            row = i - d;
+        }
+        if (i + d < h && right[(i + d) * w + x0] < x && right[(i + d) * w + x0] <= x1)
+        {
+            x = right[(i + d) * w + x0];
+            row = i + d;
+        }
+        if (x < w)
+            return src->v[(size_t)row * src->stride + x];
+    }
+    // Right column, topmost pixel
+    if (j + d < w && (r = below[lo * w + j + d]) <= hi)
+        return src->v[(size_t)r * src->stride + j + d];
+    return 0;
+}
+
+static void FillSweeps(const FillSource *src, uint32_t nsize, bool ring, uint16_t *tables, uint8_t *out, uint8_t *outmin, uint8_t *outmax)
+{
+    /* Filled map of src into the w x h out, with its min and max; tables holds 3 * w * h entries */
+    int32_t w = src->w, h = src->h;
+    int32_t half = nsize / 2;
+    int32_t far = w + h; // Vertical distance of an empty column, beyond any real one
+    uint16_t *nearest = tables, *below = tables + (size_t)w * h, *right = tables + 2 * (size_t)w * h;
+    uint8_t min = UCHAR_MAX, max = 0;
+
+    ColumnSweeps(src, nearest, below);
+
+    #pragma omp parallel reduction(min : min) reduction(max : max)
+    {
+        int32_t *s = (int32_t *)malloc(w * sizeof(int32_t)); // Columns of the lower envelope
+        int32_t *t = (int32_t *)malloc(w * sizeof(int32_t)); // First column of each segment
+        int32_t *g = (int32_t *)malloc(w * sizeof(int32_t));
+        int32_t i, j, q, u, x;
+
+        if (ring)
+        {
+            // Next valid column at or to the right, w when none
+            #pragma omp for schedule(static)
+            for (i = 0; i < h; i++)
+            {
+                right[i * w + w - 1] = Valid(src, i, w - 1) ? w - 1 : w;
+                for (x = w - 2; x >= 0; x--)
+                    right[i * w + x] = Valid(src, i, x) ? x : right[i * w + x + 1];
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for (i = 0; i < h; i++)
+        {
+            for (x = 0; x < w; x++)
+                g[x] = nearest[i * w + x] != FILL_NONE ? abs(nearest[i * w + x] - i) : far;
+
+            // Forward: lower envelope of the columns
+            q = 0;
+            s[0] = 0;
+            t[0] = 0;
+            for (u = 1; u < w; u++)
+            {
+                while (q >= 0 && Chessboard(t[q], s[q], g[s[q]]) > Chessboard(t[q], u, g[u]))
+                    q--;
+                if (q < 0)
+                {
+                    q = 0;
+                    s[0] = u;
+                }
+                else
+                {
+                    x = 1 + Sep(s[q], u, g[s[q]], g[u]);
+                    if (x < w)
+                    {
+                        q++;
+                        s[q] = u;
+                        t[q] = x;
+                    }
+                }
+            }
+
+            // Backward: distance of every pixel from its segment, then its value
+            for (j = w - 1; j >= 0; j--)
+            {
+                int32_t d = Chessboard(j, s[q], g[s[q]]);
+                uint8_t v;
+
+                if (d == 0)
+                    v = src->v[(size_t)i * src->stride + j];
+                else if (d > half)
+                    v = 0;
+                else if (ring)
+                    v = RingPixel(src, below, right, i, j, d);
+                else
+                    v = src->v[(size_t)nearest[i * w + s[q]] * src->stride + s[q]];
+                out[i * w + j] = v;
+                if (v < min)
+                    min = v;
+                if (v > max)
+                    max = v;
+                if (j == t[q])
+                    q--;
+            }
+        }
+
+        free(s);
+        free(t);
+        free(g);
+    }
+
+    *outmin = min;
+    *outmax = max;
+}
+
+uint8_t *OcclusionFillSweep(const PaddedImage *map, uint32_t nsize, bool ring)
+{
+    FillSource src = {map->data, map->stride, (int32_t)map->w, (int32_t)map->h};
+    uint8_t *result;
+    uint16_t *tables;
+    uint8_t min, max;
+
+    if (map->w > FILL_MAX_SIZE || map->h > FILL_MAX_SIZE)
+    {
+        printf("The linear-time fill needs maps up to %d pixels on a side\n", FILL_MAX_SIZE);
+        return NULL;
+    }
+    result = (uint8_t *)malloc((size_t)map->w * map->h);
+    tables = (uint16_t *)malloc(3 * (size_t)map->w * map->h * sizeof(uint16_t));
+    FillSweeps(&src, nsize, ring, tables, result, &min, &max);
+    free(tables);
+    return result;
+}
+
+size_t PostProcessScratch(uint32_t w, uint32_t h)
+{
+    return (size_t)w * h * (sizeof(uint8_t) + 3 * sizeof(uint16_t));
+}
+
+void PostProcess(const uint8_t *lr, const uint8_t *rl, uint32_t w, uint32_t h, uint32_t threshold, uint32_t nsize, void *scratch, uint8_t *out)
+{
+    /*
+     * Cross-check, fill (FILL_SWEEP, FILL_RING otherwise) and normalization of the
+     * LR and RL maps into out. The maps are read once, into the cross-checked byte
+     * plane at the end of the scratch, and the sweeps only read that plane.
+     */
+    void *buffer = scratch ? scratch : malloc(PostProcessScratch(w, h));
+    uint16_t *tables = (uint16_t *)buffer;
+    uint8_t *valid = (uint8_t *)(tables + 3 * (size_t)w * h);
+    FillSource src = {valid, w, (int32_t)w, (int32_t)h};
+    uint8_t lut[256];
+    uint8_t min, max;
+    int32_t i, v;
+
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < (int32_t)h; i++)
+        CrossCheckRow(lr + (size_t)i * w, rl + (size_t)i * w, valid + (size_t)i * w, w, threshold);
+
+    FillSweeps(&src, nsize, Fill != FILL_SWEEP, tables, out, &min, &max);
+
+    // Same arithmetic as rescale_dmap, once per value
+    for (v = 0; v < 256; v++)
+        lut[v] = max > min ? (uint8_t)(255 * (v - min) / (max - min)) : 0;
+    RemapBytes(lut, out, (size_t)w * h);
+
+    if (!scratch)
+        free(buffer);
+}
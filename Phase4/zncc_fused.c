@@ -0,0 +1,165 @@
+#include "zncc.h"
+
+#define FUSED_BAND 64 // Rows per work item of the fused engine
+
+void CALCZNCC_FUSED(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, uint8_t **dmapLR, uint8_t **dmapRL)
+{
+    /*
+     * Left-to-right and right-to-left disparity maps in a single sweep. The LR score of
+     * pixel j at disparity d pairs L(j + j_b) with R(j + j_b - d), which are exactly
+     * the taps of the RL score of pixel j - d at disparity -d, so every correlation is
+     * computed once (with the sliding box filter of CALCZNCC_BOX) and offered to both
+     * winner-take-all arrays. Only the per-band winners are kept, no cost volume.
+     * The RL pass covers [-maxd, -mind], the mirror of the LR range.
+     */
+    uint32_t w = left->w, h = left->h; // Size of the image
+    uint32_t stride = left->stride;    // Row pitch of both images
+    const uint8_t *ldata = left->data, *rdata = right->data;
+    int32_t imsize = w * h;
+    int32_t bsize = bsx * bsy; // Block size
+    int32_t nbands = (h + FUSED_BAND - 1) / FUSED_BAND;
+
+    uint8_t *mapLR = (uint8_t *)malloc(imsize);
+    uint8_t *mapRL = (uint8_t *)malloc(imsize);
+    IntegralImage iil, iir;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel shared(ldata, rdata, mapLR, mapRL, iil, iir)
+    {
+        int32_t *colsum = (int32_t *)malloc(w * sizeof(int32_t));
+        int64_t *prefix = (int64_t *)malloc((w + 1) * sizeof(int64_t));
+        double *best_lr = (double *)malloc(FUSED_BAND * w * sizeof(double));
+        double *best_rl = (double *)malloc(FUSED_BAND * w * sizeof(double));
+        int32_t *best_lr_d = (int32_t *)malloc(FUSED_BAND * w * sizeof(int32_t));
+        int32_t *best_rl_d = (int32_t *)malloc(FUSED_BAND * w * sizeof(int32_t));
+        int32_t band;
+
+        #pragma omp for schedule(dynamic)
+        for (band = 0; band < nbands; band++)
+        {
+            int32_t b0 = band * FUSED_BAND;
+            int32_t b1 = b0 + FUSED_BAND < h ? b0 + FUSED_BAND : h;
+            int32_t i, j, x, r, c, d;
+            int32_t r0, r1, c0, c1, v0, v1;
+            int32_t row; // Offset of the current row in the band arrays
+            int64_t n, sl, sr, sll, srr, slr;
+            double current_score;
+
+            for (i = 0; i < (b1 - b0) * w; i++)
+            {
+                best_lr[i] = -1;
+                best_lr_d[i] = maxd;
+                best_rl[i] = -1;
+                best_rl_d[i] = -mind;
+            }
+
+            for (d = mind; d <= maxd; d++)
+            {
+                v0 = d > 0 ? d : 0;
+                v1 = d < 0 ? w + d : w;
+
+                for (c = 0; c < w; c++)
+                    colsum[c] = 0;
+                r0 = b0 - bsy / 2 > 0 ? b0 - bsy / 2 : 0;
+                r1 = b0 + bsy / 2 < h ? b0 + bsy / 2 : h;
+                for (r = r0; r < r1; r++)
+                {
+                    const uint8_t *lrow = ldata + r * stride;
+                    const uint8_t *rrow = rdata + r * stride - d;
+                    for (c = v0; c < v1; c++)
+                        colsum[c] += lrow[c] * rrow[c];
+                }
+
+                for (i = b0; i < b1; i++)
+                {
+                    r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+                    r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+                    row = (i - b0) * w;
+
+                    if (i > b0)
+                    {
+                        r = i - 1 - bsy / 2;
+                        if (r >= 0)
+                        {
+                            const uint8_t *lrow = ldata + r * stride;
+                            const uint8_t *rrow = rdata + r * stride - d;
+                            for (c = v0; c < v1; c++)
+                                colsum[c] -= lrow[c] * rrow[c];
+                        }
+                        r = i - 1 + bsy / 2;
+                        if (r < h)
+                        {
+                            const uint8_t *lrow = ldata + r * stride;
+                            const uint8_t *rrow = rdata + r * stride - d;
+                            for (c = v0; c < v1; c++)
+                                colsum[c] += lrow[c] * rrow[c];
+                        }
+                    }
+
+                    prefix[0] = 0;
+                    for (c = 0; c < w; c++)
+                        prefix[c + 1] = prefix[c] + colsum[c];
+
+                    // j runs past the image on both sides: RL pixels near the borders pair with such windows
+                    for (j = -bsx / 2; j < (int32_t)w + bsx / 2; j++)
+                    {
+                        x = j - d; // RL pixel sharing this correlation
+                        if ((j < 0 || j >= w) && (x < 0 || x >= w))
+                            continue;
+
+                        c0 = j - bsx / 2;
+                        if (c0 < v0)
+                            c0 = v0;
+                        c1 = j + bsx / 2;
+                        if (c1 > v1)
+                            c1 = v1;
+                        if (c1 <= c0 || r1 <= r0)
+                            continue;
+
+                        n = (int64_t)(r1 - r0) * (c1 - c0);
+                        sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                        sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                        sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                        srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+                        slr = prefix[c1] - prefix[c0];
+                        current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+
+                        // LR sees d in increasing order, as in CALCZNCC
+                        if (j >= 0 && j < w && current_score > best_lr[row + j])
+                        {
+                            best_lr[row + j] = current_score;
+                            best_lr_d[row + j] = d;
+                        }
+                        // RL sees -d in decreasing order: on a tie the smaller -d wins, as it would have come first
+                        if (x >= 0 && x < w && (current_score > best_rl[row + x] || (current_score == best_rl[row + x] && current_score > -1 && -d < best_rl_d[row + x])))
+                        {
+                            best_rl[row + x] = current_score;
+                            best_rl_d[row + x] = -d;
+                        }
+                    }
+                }
+            }
+
+            for (i = 0; i < (b1 - b0) * w; i++)
+            {
+                mapLR[b0 * w + i] = (uint8_t)abs(best_lr_d[i]);
+                mapRL[b0 * w + i] = (uint8_t)abs(best_rl_d[i]);
+            }
+        }
+
+        free(colsum);
+        free(prefix);
+        free(best_lr);
+        free(best_rl);
+        free(best_lr_d);
+        free(best_rl_d);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    *dmapLR = mapLR;
+    *dmapRL = mapRL;
+}
@@ -0,0 +1,338 @@
+#include <omp.h>
+#include <string.h>
+#include "zncc.h"
+
+#ifdef ZNCC_OPENCL
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#else
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+#endif
+
+/*
+ * Hybrid CPU + OpenCL engine. The top rows of the map go to the OpenCL device, the
+ * others to CALCZNCC_SIMD rows on the host threads, both running at the same time.
+ * After every call the rows each side computed per second set the share of the
+ * device for the next call, so the split follows the throughput of the two from
+ * frame to frame. The device is the first GPU found, any OpenCL device otherwise,
+ * so a CPU runtime such as PoCL works too. Built without ZNCC_OPENCL (or when no
+ * device is found) every row runs on the host.
+ */
+
+#define HYBRID_MIN_SHARE 0.05 // Share of rows always left to each side, so both keep being measured
+#define HYBRID_HISTORY 64     // Calls kept for HybridReport
+
+typedef struct
+{
+    int32_t device_rows, host_rows;
+    double device_time, host_time; // Seconds, the device one from its profiling counters
+    double next_share;             // Share of the device for the next call
+} HybridCall;
+
+static double DeviceShare = 0.5;
+static HybridCall History[HYBRID_HISTORY];
+static int32_t Calls = 0;
+
+#ifdef ZNCC_OPENCL
+
+/*
+ * Same scores as CALCZNCC_SIMD: exact integer window sums, then the ZNCCFromSums
+ * formula, in double when the device supports it. One work item per pixel of the
+ * rows [0, get_global_size(1)); h is the height of the whole image.
+ */
+static const char *HybridKernelSource =
+    "#ifdef cl_khr_fp64\n"
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "typedef double score_t;\n"
+    "#else\n"
+    "typedef float score_t;\n"
+    "#endif\n"
+    "__kernel void zncc_rows(__global const uchar *left, __global const uchar *right, __global uchar *dmap,\n"
+    "                        int w, int h, int bsx, int bsy, int mind, int maxd)\n"
+    "{\n"
+    "    const int j = get_global_id(0);\n"
+    "    const int i = get_global_id(1);\n"
+    "    const int r0 = max(i - bsy / 2, 0), r1 = min(i + bsy / 2, h);\n"
+    "    const long bsize = bsx * bsy;\n"
+    "    int best_d = maxd, d, r, c, c0, c1;\n"
+    "    score_t best_score = -1, score;\n"
+    "\n"
+    "    if (j >= w)\n"
+    "        return;\n"
+    "    for (d = mind; d <= maxd; d++)\n"
+    "    {\n"
+    "        long n, sl = 0, sr = 0, sll = 0, srr = 0, slr = 0, num, lvar, rvar;\n"
+    "        c0 = max(max(j - bsx / 2, 0), d);\n"
+    "        c1 = min(min(j + bsx / 2, w), w + d);\n"
+    "        if (c1 <= c0 || r1 <= r0)\n"
+    "            continue;\n"
+    "        for (r = r0; r < r1; r++)\n"
+    "        {\n"
+    "            for (c = c0; c < c1; c++)\n"
+    "            {\n"
+    "                int l = left[r * w + c], rr = right[r * w + c - d];\n"
+    "                sl += l;\n"
+    "                sr += rr;\n"
+    "                sll += l * l;\n"
+    "                srr += rr * rr;\n"
+    "                slr += l * rr;\n"
+    "            }\n"
+    "        }\n"
+    "        n = (long)(r1 - r0) * (c1 - c0);\n"
+    "        num = bsize * bsize * slr - 2 * bsize * sl * sr + n * sl * sr;\n"
+    "        lvar = bsize * bsize * sll - 2 * bsize * sl * sl + n * sl * sl;\n"
+    "        rvar = bsize * bsize * srr - 2 * bsize * sr * sr + n * sr * sr;\n"
+    "        score = lvar <= 0 || rvar <= 0 ? -1 : num / (sqrt((score_t)lvar) * sqrt((score_t)rvar));\n"
+    "        if (score > best_score)\n"
+    "        {\n"
+    "            best_score = score;\n"
+    "            best_d = d;\n"
+    "        }\n"
+    "    }\n"
+    "    dmap[i * w + j] = (uchar)abs(best_d);\n"
+    "}\n";
+
+typedef struct
+{
+    bool tried, ok;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+    cl_mem left, right, dmap;
+    uint32_t w, h; // Size the buffers were created for
+} HybridDevice;
+
+static HybridDevice Device = {false, false};
+
+static bool PickDevice(cl_device_id *device)
+{
+    /* First GPU of any platform, otherwise the first device of any type */
+    cl_platform_id platforms[8];
+    cl_uint nplatforms = 0, p, n;
+
+    if (clGetPlatformIDs(8, platforms, &nplatforms) != CL_SUCCESS || nplatforms == 0)
+        return false;
+    if (nplatforms > 8)
+        nplatforms = 8;
+    for (p = 0; p < nplatforms; p++)
+    {
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_GPU, 1, device, &n) == CL_SUCCESS && n > 0)
+            return true;
+    }
+    for (p = 0; p < nplatforms; p++)
+    {
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 1, device, &n) == CL_SUCCESS && n > 0)
+            return true;
+    }
+    return false;
+}
+
+static bool InitDevice(void)
+{
+    /* Context, queue and kernel, built on the first call only */
+    cl_device_id device;
+    cl_int err;
+    char name[256];
+
+    if (Device.tried)
+        return Device.ok;
+    Device.tried = true;
+
+    if (!PickDevice(&device))
+    {
+        printf("Hybrid: no OpenCL device, every row runs on the host\n");
+        return false;
+    }
+    Device.context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+    if (err != CL_SUCCESS)
+        return false;
+    Device.queue = clCreateCommandQueue(Device.context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    if (err != CL_SUCCESS)
+        return false;
+    Device.program = clCreateProgramWithSource(Device.context, 1, &HybridKernelSource, NULL, &err);
+    if (err != CL_SUCCESS || clBuildProgram(Device.program, 1, &device, NULL, NULL, NULL) != CL_SUCCESS)
+    {
+        printf("Hybrid: the kernel does not build, every row runs on the host\n");
+        return false;
+    }
+    Device.kernel = clCreateKernel(Device.program, "zncc_rows", &err);
+    if (err != CL_SUCCESS)
+        return false;
+
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    name[sizeof(name) - 1] = 0;
+    printf("Hybrid: OpenCL device %s\n", name);
+    Device.ok = true;
+    return true;
+}
+
+static bool DeviceBuffers(uint32_t w, uint32_t h)
+{
+    /* Buffers for w x h images, recreated only when the size changes */
+    cl_int e1, e2, e3;
+
+    if (Device.w == w && Device.h == h)
+        return true;
+    if (Device.w > 0)
+    {
+        clReleaseMemObject(Device.left);
+        clReleaseMemObject(Device.right);
+        clReleaseMemObject(Device.dmap);
+    }
+    Device.left = clCreateBuffer(Device.context, CL_MEM_READ_ONLY, (size_t)w * h, NULL, &e1);
+    Device.right = clCreateBuffer(Device.context, CL_MEM_READ_ONLY, (size_t)w * h, NULL, &e2);
+    Device.dmap = clCreateBuffer(Device.context, CL_MEM_WRITE_ONLY, (size_t)w * h, NULL, &e3);
+    Device.w = Device.h = 0;
+    if (e1 != CL_SUCCESS || e2 != CL_SUCCESS || e3 != CL_SUCCESS)
+        return false;
+    Device.w = w;
+    Device.h = h;
+    return true;
+}
+
+static bool EnqueueDevice(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd,
+                          int32_t rows, uint8_t *dmap, cl_event *first, cl_event *last)
+{
+    /* Uploads the rows the windows of [0, rows) need, runs the kernel and reads the rows back, without waiting */
+    cl_int w = left->w, h = left->h;
+    size_t need = rows + bsy / 2 < h ? rows + bsy / 2 : h;
+    size_t origin[3] = {0, 0, 0}, region[3] = {(size_t)w, need, 1};
+    size_t global[2] = {(size_t)w, (size_t)rows};
+    cl_int err;
+
+    if (!DeviceBuffers(w, h))
+        return false;
+    // Interior rows of the padded images, packed on the way
+    err = clEnqueueWriteBufferRect(Device.queue, Device.left, CL_FALSE, origin, origin, region, w, 0, left->stride, 0, left->data, 0, NULL, first);
+    err |= clEnqueueWriteBufferRect(Device.queue, Device.right, CL_FALSE, origin, origin, region, w, 0, right->stride, 0, right->data, 0, NULL, NULL);
+    err |= clSetKernelArg(Device.kernel, 0, sizeof(cl_mem), &Device.left);
+    err |= clSetKernelArg(Device.kernel, 1, sizeof(cl_mem), &Device.right);
+    err |= clSetKernelArg(Device.kernel, 2, sizeof(cl_mem), &Device.dmap);
+    err |= clSetKernelArg(Device.kernel, 3, sizeof(cl_int), &w);
+    err |= clSetKernelArg(Device.kernel, 4, sizeof(cl_int), &h);
+    err |= clSetKernelArg(Device.kernel, 5, sizeof(cl_int), &bsx);
+    err |= clSetKernelArg(Device.kernel, 6, sizeof(cl_int), &bsy);
+    err |= clSetKernelArg(Device.kernel, 7, sizeof(cl_int), &mind);
+    err |= clSetKernelArg(Device.kernel, 8, sizeof(cl_int), &maxd);
+    err |= clEnqueueNDRangeKernel(Device.queue, Device.kernel, 2, NULL, global, NULL, 0, NULL, NULL);
+    err |= clEnqueueReadBuffer(Device.queue, Device.dmap, CL_FALSE, 0, (size_t)w * rows, dmap, 0, NULL, last);
+    err |= clFlush(Device.queue);
+    return err == CL_SUCCESS;
+}
+
+static double DeviceSeconds(cl_event first, cl_event last)
+{
+    /* From the start of the first upload to the end of the read back, on the device clock */
+    cl_ulong start = 0, end = 0;
+
+    clGetEventProfilingInfo(first, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(last, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    return (end - start) * 1e-9;
+}
+
+#endif
+
+static void HostRows(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, int32_t r0, uint8_t *dmap)
+{
+    /* Rows [r0, h) with the CALCZNCC_SIMD kernels on the host threads */
+    uint32_t w = left->w, h = left->h;
+    IntegralImage iil, iir;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel
+    {
+        double *best_score = (double *)malloc(w * sizeof(double));
+        int32_t *best_d = (int32_t *)malloc(w * sizeof(int32_t));
+        int32_t i;
+
+        #pragma omp for schedule(dynamic, 4)
+        for (i = r0; i < h; i++)
+            ZNCCSimdRows(left, right, &iil, &iir, 0, h, i, i + 1, bsx, bsy, mind, maxd, best_score, best_d, dmap, NULL, NULL);
+
+        free(best_score);
+        free(best_d);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+}
+
+uint8_t *CALCZNCC_HYBRID(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    uint32_t h = left->h; // Height of the image
+    uint8_t *dmap = (uint8_t *)malloc(left->w * h); // Memory allocation for the disparity map
+    int32_t device_rows = 0;
+    double t0, host_time, device_time = 0;
+    HybridCall call;
+#ifdef ZNCC_OPENCL
+    cl_event first, last;
+#endif
+
+#ifdef ZNCC_OPENCL
+    if (InitDevice())
+    {
+        device_rows = (int32_t)(DeviceShare * h + 0.5);
+        if (device_rows > 0 && !EnqueueDevice(left, right, bsx, bsy, mind, maxd, device_rows, dmap, &first, &last))
+        {
+            printf("Hybrid: enqueueing on the device failed, every row runs on the host\n");
+            clFinish(Device.queue);
+            Device.ok = false;
+            device_rows = 0;
+        }
+    }
+#endif
+
+    // The host rows run while the device works on its own
+    t0 = omp_get_wtime();
+    HostRows(left, right, bsx, bsy, mind, maxd, device_rows, dmap);
+    host_time = omp_get_wtime() - t0;
+
+#ifdef ZNCC_OPENCL
+    if (device_rows > 0)
+    {
+        clWaitForEvents(1, &last);
+        device_time = DeviceSeconds(first, last);
+        clReleaseEvent(first);
+        clReleaseEvent(last);
+    }
+#endif
+
+    // Share of the device proportional to its throughput (rows per second) against the host's
+    if (device_rows > 0 && device_rows < h && device_time > 0 && host_time > 0)
+    {
+        double device_rate = device_rows / device_time, host_rate = (h - device_rows) / host_time;
+        DeviceShare = device_rate / (device_rate + host_rate);
+        if (DeviceShare < HYBRID_MIN_SHARE)
+            DeviceShare = HYBRID_MIN_SHARE;
+        if (DeviceShare > 1 - HYBRID_MIN_SHARE)
+            DeviceShare = 1 - HYBRID_MIN_SHARE;
+    }
+
+    call.device_rows = device_rows;
+    call.host_rows = h - device_rows;
+    call.device_time = device_time;
+    call.host_time = host_time;
+    call.next_share = device_rows > 0 ? DeviceShare : 0;
+    History[Calls % HYBRID_HISTORY] = call;
+    Calls++;
+
+    return dmap;
+}
+
+void HybridReport(void)
+{
+    /* The split of every call so far, oldest first */
+    int32_t k = Calls > HYBRID_HISTORY ? Calls - HYBRID_HISTORY : 0;
+
+    for (; k < Calls; k++)
+    {
+        const HybridCall *c = &History[k % HYBRID_HISTORY];
+        printf("Hybrid call %d: device %d rows in %.6f s, host %d rows in %.6f s, next device share %.2f\n", k, c->device_rows, c->device_time,
+               c->host_rows, c->host_time, c->next_share);
+    }
+}
@@ -0,0 +1,69 @@
+#include <string.h>
+#include "zncc.h"
+
+static uint32_t RoundUp(uint32_t x, uint32_t a)
+{
+    return (x + a - 1) / a * a;
+}
+
+size_t PaddedImageBytes(uint32_t w, uint32_t h, uint32_t halo)
+{
+    uint32_t lead = RoundUp(halo, IMAGE_ALIGN); // Left border, rounded so that every row of the interior is aligned
+
+    return (size_t)RoundUp(lead + w + halo, IMAGE_ALIGN) * (h + 2 * halo);
+}
+
+void PlacePaddedImage(PaddedImage *img, uint8_t *buf, uint32_t w, uint32_t h, uint32_t halo)
+{
+    /* Interior of w x h pixels with halo pixels of zeros on every side, laid out in buf */
+    uint32_t lead = RoundUp(halo, IMAGE_ALIGN);
+    int32_t i;
+
+    img->w = w;
+    img->h = h;
+    img->halo = halo;
+    img->mode = HALO_ZERO;
+    img->stride = RoundUp(lead + w + halo, IMAGE_ALIGN);
+    img->buf = buf;
+    img->data = img->buf + (size_t)halo * img->stride + lead;
+
+    // First touch of the interior with the static row split of the engines, so rows land on the node of the thread computing them
+    memset(img->buf, 0, (size_t)img->stride * halo);
+    #pragma omp parallel for schedule(static)
+    for (i = 0; i < h; i++)
+        memset(img->buf + (size_t)(halo + i) * img->stride, 0, img->stride);
+    memset(img->buf + (size_t)(halo + h) * img->stride, 0, (size_t)img->stride * halo);
+}
+
+bool AllocPaddedImage(PaddedImage *img, uint32_t w, uint32_t h, uint32_t halo)
+{
+    /* Interior of w x h pixels with halo pixels of zeros on every side */
+    uint8_t *buf;
+
+    if (posix_memalign((void **)&buf, IMAGE_ALIGN, PaddedImageBytes(w, h, halo)) != 0)
+    {
+        img->buf = NULL;
+        img->data = NULL;
+        return false;
+    }
+    PlacePaddedImage(img, buf, w, h, halo);
+    return true;
+}
+
+void FreePaddedImage(PaddedImage *img)
+{
+    free(img->buf);
+    img->buf = NULL;
+    img->data = NULL;
+}
+
+uint8_t *PackImage(const PaddedImage *img)
+{
+    /* Contiguous copy of the interior, e.g. for encoding */
+    uint8_t *packed = (uint8_t *)malloc((size_t)img->w * img->h);
+    uint32_t i;
+
+    for (i = 0; i < img->h; i++)
+        memcpy(packed + (size_t)i * img->w, img->data + (size_t)i * img->stride, img->w);
+    return packed;
+}
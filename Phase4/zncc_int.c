@@ -0,0 +1,129 @@
+#include "zncc.h"
+
+uint8_t *CALCZNCC_INT(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /*
+     * Disparity map computation in exact integer arithmetic: integral images for the
+     * window sums, the vector kernels of CALCZNCC_SIMD for the cross term, and a
+     * winner-take-all that orders the scores by cross-multiplication (ZNCCGreater)
+     * instead of taking square roots and dividing.
+     */
+    int32_t w = left->w, h = left->h; // Size of the image, signed so that w + d is negative for d < -w
+    uint32_t stride = left->stride;    // Row pitch of both images
+    const uint8_t *ldata = left->data, *rdata = right->data;
+    int32_t imsize = w * h;
+    int32_t bsize = bsx * bsy; // Block size
+    int32_t taps = 2 * (bsx / 2); // Columns of the window, j_b in [-bsx / 2, bsx / 2)
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+    CrossTermKernel kernel;
+    int32_t lanes;
+    bool padded; // Zero halos wide enough for the kernel to score the border pixels as well
+    // Largest possible variance term, bsize^2 * bsize * 255^2, decides whether num^2 * var fits in 128 bits
+    double max_var = (double)bsize * bsize * bsize * 255.0 * 255.0;
+    bool small_terms = max_var < 4398046511104.0; // 2^42, so that max_var^3 < 2^126
+
+    kernel = SelectCrossTermKernel(&lanes);
+    padded = ZeroHaloCovers(left, right, bsx, mind, maxd);
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel shared(ldata, rdata, dmap, iil, iir)
+    {
+        ZNCCTerms *best_score = (ZNCCTerms *)malloc(w * sizeof(ZNCCTerms));
+        int32_t *best_d = (int32_t *)malloc(w * sizeof(int32_t));
+        int32_t slr_block[16];
+        int32_t i;
+
+        #pragma omp for
+        for (i = 0; i < h; i++)
+        {
+            int32_t r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+            int32_t r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+            int32_t j, d;
+            int32_t c0, c1;
+            int32_t jlo, jhi; // Pixels scored by the kernel, [jlo, jhi)
+            int64_t n, sl, sr, sll, srr, slr;
+            ZNCCTerms current_score;
+
+            for (j = 0; j < w; j++)
+            {
+                best_score[j] = ZNCCTermsMinusOne;
+                best_d[j] = maxd;
+            }
+
+            for (d = mind; d <= maxd; d++)
+            {
+                if (padded)
+                {
+                    // Taps outside either image read halo zeros, so the kernel covers the whole row
+                    jlo = 0;
+                    jhi = w;
+                }
+                else
+                {
+                    // Only the windows lying inside both images
+                    jlo = bsx / 2 + (d > 0 ? d : 0);
+                    jhi = (d < 0 ? (int32_t)w + d : (int32_t)w) - bsx / 2 + 1;
+                    jhi = jhi > jlo ? jlo + (jhi - jlo) / lanes * lanes : jlo;
+                }
+
+                for (j = 0; j < w; j++)
+                {
+                    // One kernel call scores the next lanes pixels
+                    if (j >= jlo && j < jhi && (j - jlo) % lanes == 0 && r1 > r0)
+                        kernel(ldata, rdata, stride, r0, r1, j - bsx / 2, taps, d, slr_block);
+
+                    // Same taps as the border checks of CALCZNCC
+                    c0 = j - bsx / 2;
+                    if (c0 < 0)
+                        c0 = 0;
+                    if (c0 < d)
+                        c0 = d;
+                    c1 = j + bsx / 2;
+                    if (c1 > w)
+                        c1 = w;
+                    if (c1 > w + d)
+                        c1 = w + d;
+                    if (c1 <= c0 || r1 <= r0)
+                        continue;
+
+                    if (j >= jlo && j < jhi)
+                        slr = slr_block[(j - jlo) % lanes];
+                    else
+                        slr = CrossTermClipped(ldata, rdata, stride, r0, r1, c0, c1, d);
+
+                    n = (int64_t)(r1 - r0) * (c1 - c0);
+                    sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                    sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                    sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                    srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+
+                    current_score = ZNCCTermsFromSums(n, bsize, sl, sr, sll, srr, slr);
+                    // Flat windows have no score (NaN in CALCZNCC)
+                    if (current_score.lvar <= 0 || current_score.rvar <= 0)
+                        continue;
+                    // Selecting the best disparity
+                    if (ZNCCGreater(&current_score, &best_score[j], small_terms))
+                    {
+                        best_score[j] = current_score;
+                        best_d[j] = d;
+                    }
+                }
+            }
+
+            for (j = 0; j < w; j++)
+                dmap[i * w + j] = (uint8_t)abs(best_d[j]); // Considering both Left to Right and Right to left disparities
+        }
+
+        free(best_score);
+        free(best_d);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
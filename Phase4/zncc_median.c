@@ -0,0 +1,332 @@
+#include <omp.h>
+#include <string.h>
+#include "zncc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZNCC_X86
+#endif
+
+/*
+ * Median filter of a map over (2r + 1) x (2r + 1) windows, borders replicated.
+ *
+ * Radii 1 and 2 run a sorting network on whole vectors of pixels: the window of
+ * 32 (AVX2) or 16 (SSE2) adjacent pixels is loaded as 9 or 25 shifted vectors and
+ * the compare-exchanges become byte min/max. The network is Batcher's odd-even
+ * merge sort of 16 or 32 inputs with the padding inputs and every exchange that
+ * cannot reach the middle output removed.
+ *
+ * Larger radii use the histogram method of Perreault and Hebert: a histogram per
+ * column of the window height, moved one row down per output row, and a window
+ * histogram moved one column right per pixel by adding the entering column and
+ * subtracting the leaving one. A 16-bin coarse level finds the 16 values holding
+ * the median, so every pixel costs the same whatever the radius. Every thread
+ * runs the method on its own band of rows.
+ */
+
+#define MEDIAN_MAX_TAPS 25   // Inputs of the largest network (5x5)
+#define MEDIAN_MAX_PAIRS 256 // Compare-exchanges of the largest pruned network
+
+typedef struct
+{
+    int32_t taps;                          // Inputs, (2r + 1)^2
+    int32_t npairs;
+    uint8_t pairs[MEDIAN_MAX_PAIRS][2];    // Compare-exchanges in order, min to the first
+} MedianNetwork;
+
+static MedianNetwork Networks[3]; // By radius, 1 and 2 used
+
+static void BuildNetwork(MedianNetwork *net, int32_t taps)
+{
+    /* Batcher's odd-even merge sort of the next power of two, pruned to the median of taps inputs */
+    uint8_t all[1024][2];
+    bool needed[32] = {false};
+    int32_t n = 1, count = 0, p, k, j, i, c;
+
+    while (n < taps)
+        n *= 2;
+    for (p = 1; p < n; p *= 2)
+    {
+        for (k = p; k >= 1; k /= 2)
+        {
+            for (j = k % p; j + k < n; j += 2 * k)
+            {
+                for (i = 0; i < k && i + j + k < n; i++)
+                {
+                    // Only within the same block of 2p inputs; inputs past taps are +inf and never move
+                    if ((i + j) / (2 * p) == (i + j + k) / (2 * p) && i + j + k < taps)
+                    {
+                        all[count][0] = i + j;
+                        all[count][1] = i + j + k;
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Backwards from the middle output, keeping the exchanges that feed it
+    needed[taps / 2] = true;
+    net->taps = taps;
+    net->npairs = 0;
+    for (c = count - 1; c >= 0; c--)
+    {
+        if (needed[all[c][0]] || needed[all[c][1]])
+        {
+            needed[all[c][0]] = needed[all[c][1]] = true;
+            net->npairs++;
+        }
+        else
+            all[c][0] = all[c][1] = 0; // Dropped
+    }
+    for (c = 0, k = 0; c < count; c++)
+    {
+        if (all[c][0] != all[c][1])
+        {
+            net->pairs[k][0] = all[c][0];
+            net->pairs[k][1] = all[c][1];
+            k++;
+        }
+    }
+}
+
+static void PadRows(const uint8_t *map, uint32_t w, uint32_t h, int32_t r, uint8_t *padded, uint32_t pstride)
+{
+    /* Rows of map with r replicated pixels on each side, the rest of the stride replicating the last one */
+    int32_t i, x;
+
+    #pragma omp parallel for private(x)
+    for (i = 0; i < h; i++)
+    {
+        uint8_t *row = padded + (size_t)i * pstride;
+        memcpy(row + r, map + (size_t)i * w, w);
+        for (x = 0; x < r; x++)
+            row[x] = map[(size_t)i * w];
+        for (x = r + w; x < pstride; x++)
+            row[x] = map[(size_t)i * w + w - 1];
+    }
+}
+
+static void NetworkRowGeneric(const MedianNetwork *net, const uint8_t *const *rows, int32_t r, int32_t x0, int32_t x1, uint8_t *out)
+{
+    uint8_t v[MEDIAN_MAX_TAPS], a;
+    int32_t x, dy, dx, k, c;
+
+    for (x = x0; x < x1; x++)
+    {
+        k = 0;
+        for (dy = 0; dy <= 2 * r; dy++)
+        {
+            for (dx = 0; dx <= 2 * r; dx++)
+                v[k++] = rows[dy][x + dx];
+        }
+        for (c = 0; c < net->npairs; c++)
+        {
+            a = v[net->pairs[c][0]];
+            if (a > v[net->pairs[c][1]])
+            {
+                v[net->pairs[c][0]] = v[net->pairs[c][1]];
+                v[net->pairs[c][1]] = a;
+            }
+        }
+        out[x] = v[net->taps / 2];
+    }
+}
+
+#ifdef ZNCC_X86
+static int32_t NetworkRowSSE2(const MedianNetwork *net, const uint8_t *const *rows, int32_t r, int32_t w, uint8_t *out)
+{
+    /* Pixels [0, returned) of the row, 16 at a time */
+    __m128i v[MEDIAN_MAX_TAPS], a;
+    int32_t x, dy, dx, k, c;
+
+    for (x = 0; x + 16 <= w; x += 16)
+    {
+        k = 0;
+        for (dy = 0; dy <= 2 * r; dy++)
+        {
+            for (dx = 0; dx <= 2 * r; dx++)
+                v[k++] = _mm_loadu_si128((const __m128i *)(rows[dy] + x + dx));
+        }
+        for (c = 0; c < net->npairs; c++)
+        {
+            a = v[net->pairs[c][0]];
+            v[net->pairs[c][0]] = _mm_min_epu8(a, v[net->pairs[c][1]]);
+            v[net->pairs[c][1]] = _mm_max_epu8(a, v[net->pairs[c][1]]);
+        }
+        _mm_storeu_si128((__m128i *)(out + x), v[net->taps / 2]);
+    }
+    return x;
+}
+
+__attribute__((target("avx2")))
+static int32_t NetworkRowAVX2(const MedianNetwork *net, const uint8_t *const *rows, int32_t r, int32_t w, uint8_t *out)
+{
+    /* Pixels [0, returned) of the row, 32 at a time */
+    __m256i v[MEDIAN_MAX_TAPS], a;
+    int32_t x, dy, dx, k, c;
+
+    for (x = 0; x + 32 <= w; x += 32)
+    {
+        k = 0;
+        for (dy = 0; dy <= 2 * r; dy++)
+        {
+            for (dx = 0; dx <= 2 * r; dx++)
+                v[k++] = _mm256_loadu_si256((const __m256i *)(rows[dy] + x + dx));
+        }
+        for (c = 0; c < net->npairs; c++)
+        {
+            a = v[net->pairs[c][0]];
+            v[net->pairs[c][0]] = _mm256_min_epu8(a, v[net->pairs[c][1]]);
+            v[net->pairs[c][1]] = _mm256_max_epu8(a, v[net->pairs[c][1]]);
+        }
+        _mm256_storeu_si256((__m256i *)(out + x), v[net->taps / 2]);
+    }
+    return x;
+}
+#endif
+
+static void MedianNetworkFilter(const uint8_t *map, uint32_t w, uint32_t h, int32_t r, uint8_t *out)
+{
+    const MedianNetwork *net = &Networks[r];
+    const char *variant = ZNCCSimdVariant();
+    uint32_t pstride = (w + 2 * r + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    uint8_t *padded = (uint8_t *)malloc((size_t)pstride * h);
+    int32_t i;
+
+    PadRows(map, w, h, r, padded, pstride);
+
+    #pragma omp parallel for
+    for (i = 0; i < h; i++)
+    {
+        const uint8_t *rows[2 * 2 + 1];
+        int32_t dy, y, x = 0;
+
+        for (dy = -r; dy <= r; dy++)
+        {
+            y = i + dy < 0 ? 0 : (i + dy >= (int32_t)h ? h - 1 : i + dy);
+            rows[dy + r] = padded + (size_t)y * pstride;
+        }
+#ifdef ZNCC_X86
+        if (strcmp(variant, "avx512") == 0 || strcmp(variant, "avx2") == 0)
+            x = NetworkRowAVX2(net, rows, r, w, out + (size_t)i * w);
+        else if (strcmp(variant, "sse4.1") == 0)
+            x = NetworkRowSSE2(net, rows, r, w, out + (size_t)i * w);
+#endif
+        NetworkRowGeneric(net, rows, r, x, w, out + (size_t)i * w);
+    }
+
+    free(padded);
+}
+
+static inline void AddHistogram(uint16_t *dst, const uint16_t *add, const uint16_t *sub, int32_t n)
+{
+    /* dst += add - sub over n bins, a multiple of 16, vectorized by the compiler */
+    int32_t b;
+
+    for (b = 0; b < n; b++)
+        dst[b] += add[b] - sub[b];
+}
+
+static void MedianHistogramBand(const uint8_t *map, uint32_t w, uint32_t h, int32_t r, int32_t i0, int32_t i1, uint8_t *out)
+{
+    /* Rows [i0, i1) of the output; column histograms start at row i0 */
+    int32_t rank = (2 * r + 1) * (2 * r + 1) / 2;
+    uint16_t *fine = (uint16_t *)calloc((size_t)w * 256, sizeof(uint16_t)); // Column histograms
+    uint16_t *coarse = (uint16_t *)calloc((size_t)w * 16, sizeof(uint16_t));
+    uint16_t kfine[256], kcoarse[16];
+    int32_t i, x, c, dy, y;
+
+    // Column histograms of rows i0 - r .. i0 + r, clamped
+    for (dy = -r; dy <= r; dy++)
+    {
+        y = i0 + dy < 0 ? 0 : (i0 + dy >= (int32_t)h ? h - 1 : i0 + dy);
+        for (x = 0; x < w; x++)
+        {
+            uint8_t v = map[(size_t)y * w + x];
+            fine[(size_t)x * 256 + v]++;
+            coarse[x * 16 + v / 16]++;
+        }
+    }
+
+    for (i = i0; i < i1; i++)
+    {
+        if (i > i0)
+        {
+            // Down one row: row i + r enters, row i - r - 1 leaves
+            int32_t yin = i + r >= (int32_t)h ? h - 1 : i + r;
+            int32_t yout = i - r - 1 < 0 ? 0 : i - r - 1;
+            for (x = 0; x < w; x++)
+            {
+                uint8_t vin = map[(size_t)yin * w + x], vout = map[(size_t)yout * w + x];
+                fine[(size_t)x * 256 + vin]++;
+                fine[(size_t)x * 256 + vout]--;
+                coarse[x * 16 + vin / 16]++;
+                coarse[x * 16 + vout / 16]--;
+            }
+        }
+
+        // Window of column 0: columns -r .. r, clamped
+        memset(kfine, 0, sizeof(kfine));
+        memset(kcoarse, 0, sizeof(kcoarse));
+        for (c = -r; c <= r; c++)
+        {
+            int32_t cx = c < 0 ? 0 : (c >= (int32_t)w ? w - 1 : c);
+            for (x = 0; x < 256; x++)
+                kfine[x] += fine[(size_t)cx * 256 + x];
+            for (x = 0; x < 16; x++)
+                kcoarse[x] += coarse[cx * 16 + x];
+        }
+
+        for (x = 0; x < w; x++)
+        {
+            int32_t sum = 0, b, v;
+
+            if (x > 0)
+            {
+                int32_t cin = x + r >= (int32_t)w ? w - 1 : x + r;
+                int32_t cout = x - r - 1 < 0 ? 0 : x - r - 1;
+                AddHistogram(kcoarse, coarse + cin * 16, coarse + cout * 16, 16);
+                AddHistogram(kfine, fine + (size_t)cin * 256, fine + (size_t)cout * 256, 256);
+            }
+
+            // Coarse bin holding the median, then the value inside it
+            for (b = 0; sum + kcoarse[b] <= rank; b++)
+                sum += kcoarse[b];
+            for (v = 16 * b; sum + kfine[v] <= rank; v++)
+                sum += kfine[v];
+            out[(size_t)i * w + x] = v;
+        }
+    }
+
+    free(fine);
+    free(coarse);
+}
+
+uint8_t *MedianFilter(const uint8_t *map, uint32_t w, uint32_t h, int32_t radius)
+{
+    uint8_t *out;
+
+    if (radius < 1 || radius > MEDIAN_MAX_RADIUS)
+        return NULL;
+    out = (uint8_t *)malloc((size_t)w * h);
+
+    if (radius <= 2)
+    {
+        if (Networks[radius].taps == 0)
+            BuildNetwork(&Networks[radius], (2 * radius + 1) * (2 * radius + 1));
+        MedianNetworkFilter(map, w, h, radius, out);
+        return out;
+    }
+
+    // A band of rows per thread, each paying the column histograms of its first row once
+    #pragma omp parallel
+    {
+        int32_t nthreads = omp_get_num_threads(), me = omp_get_thread_num();
+        int32_t i0 = (int64_t)h * me / nthreads, i1 = (int64_t)h * (me + 1) / nthreads;
+
+        if (i1 > i0)
+            MedianHistogramBand(map, w, h, radius, i0, i1, out);
+    }
+    return out;
+}
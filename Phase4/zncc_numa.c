@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <omp.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include "zncc.h"
+
+/*
+ * NUMA placement. Pages land on the node of the thread that touches them first,
+ * so AllocPaddedImage zeroes the interior rows with the static row split of the
+ * engines and each thread ends up owning the rows it computes. NumaSetup pins the
+ * OpenMP threads to an explicit CPU list, which keeps that split on the same node
+ * for the whole run, and records the node of every thread. The read-only images
+ * can be copied to every node; NumaLocal hands a thread the copy of its own node.
+ * The node queries go through the raw system calls, so no libnuma is needed; on
+ * other systems everything runs as a single node.
+ */
+
+#define NUMA_MAX_NODES 64    // Nodes a replica can be made for
+#define NUMA_MAX_REPLICAS 8  // Images that can be replicated
+
+#define MPOL_BIND_POLICY 2 // MPOL_BIND of <numaif.h>
+
+NumaConfig Numa = {false, false, NULL};
+
+static int32_t *ThreadNode = NULL; // Node of every OpenMP thread, set by NumaSetup
+static int32_t ThreadCount = 0;
+static int32_t NodeCount = 1;
+
+typedef struct
+{
+    const uint8_t *data;                  // Interior of the original image
+    PaddedImage copies[NUMA_MAX_NODES];   // One per node, buf mapped with mmap
+    size_t size;                          // Bytes of every mapping
+} Replica;
+
+static Replica Replicas[NUMA_MAX_REPLICAS];
+static int32_t ReplicaCount = 0;
+
+static int32_t ParseCpuList(const char *list, int32_t *cpus, int32_t max)
+{
+    /* "0-3,8,10-11" into cpus; returns the number of entries or -1 on a syntax error */
+    int32_t n = 0, a, b, k;
+    char *end;
+
+    while (*list)
+    {
+        a = strtol(list, &end, 10);
+        if (end == list || a < 0)
+            return -1;
+        b = a;
+        list = end;
+        if (*list == '-')
+        {
+            b = strtol(list + 1, &end, 10);
+            if (end == list + 1 || b < a)
+                return -1;
+            list = end;
+        }
+        for (k = a; k <= b && n < max; k++)
+            cpus[n++] = k;
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return -1;
+    }
+    return n;
+}
+
+static int32_t CurrentNode(void)
+{
+#ifdef __linux__
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return node;
+#endif
+    return 0;
+}
+
+bool NumaSetup(void)
+{
+    /* Pins thread k to the k-th CPU of Numa.affinity (cycling through the list) and records the node of every thread */
+    int32_t nthreads = omp_get_max_threads();
+    int32_t *cpus = (int32_t *)malloc(CPU_SETSIZE * sizeof(int32_t));
+    int32_t ncpus = 0, k;
+    bool ok = true;
+
+    if (Numa.affinity)
+    {
+        ncpus = ParseCpuList(Numa.affinity, cpus, CPU_SETSIZE);
+        if (ncpus <= 0)
+        {
+            printf("Invalid affinity map: %s\n", Numa.affinity);
+            free(cpus);
+            return false;
+        }
+    }
+
+    free(ThreadNode);
+    ThreadNode = (int32_t *)malloc(nthreads * sizeof(int32_t));
+    ThreadCount = nthreads;
+
+    #pragma omp parallel num_threads(nthreads) reduction(&& : ok)
+    {
+        int32_t me = omp_get_thread_num();
+#ifdef __linux__
+        if (ncpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[me % ncpus], &set);
+            ok = sched_setaffinity(0, sizeof(set), &set) == 0;
+        }
+#endif
+        ThreadNode[me] = CurrentNode();
+    }
+    if (!ok)
+        printf("Could not pin every thread to %s, running with the nodes below\n", Numa.affinity);
+
+    NodeCount = 1;
+    for (k = 0; k < nthreads; k++)
+    {
+        if (ThreadNode[k] + 1 > NodeCount)
+            NodeCount = ThreadNode[k] + 1;
+    }
+    for (k = 0; k < nthreads; k++)
+        printf("Thread %2d: node %d%s\n", k, ThreadNode[k], ncpus > 0 ? "" : " (not pinned)");
+
+    free(cpus);
+    return true;
+}
+
+static int32_t ThreadNodeOf(int32_t thread)
+{
+    return ThreadNode && thread < ThreadCount ? ThreadNode[thread] : 0;
+}
+
+bool NumaReplicate(const PaddedImage *img)
+{
+    /* Copies img, halo included, to memory bound to every node that runs a thread */
+    Replica *rep;
+    int32_t n;
+
+    if (ReplicaCount == NUMA_MAX_REPLICAS || NodeCount > NUMA_MAX_NODES)
+        return false;
+    rep = &Replicas[ReplicaCount];
+    rep->data = img->data;
+    rep->size = (size_t)img->stride * (img->h + 2 * img->halo);
+
+    for (n = 0; n < NodeCount; n++)
+    {
+        PaddedImage *copy = &rep->copies[n];
+
+        *copy = *img;
+#ifdef __linux__
+        {
+            unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+
+            copy->buf = (uint8_t *)mmap(NULL, rep->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (copy->buf == MAP_FAILED)
+            {
+                for (n--; n >= 0; n--)
+                    munmap(rep->copies[n].buf, rep->size);
+                return false;
+            }
+            // Bound before the copy touches the pages; a failure (no NUMA support) leaves the default policy
+            mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+            syscall(SYS_mbind, copy->buf, rep->size, MPOL_BIND_POLICY, mask, NUMA_MAX_NODES + 1, 0);
+        }
+#else
+        copy->buf = (uint8_t *)malloc(rep->size);
+#endif
+        memcpy(copy->buf, img->buf, rep->size);
+        copy->data = copy->buf + (img->data - img->buf);
+    }
+    ReplicaCount++;
+    return true;
+}
+
+const PaddedImage *NumaLocal(const PaddedImage *img)
+{
+    /* Copy of img on the node of the calling thread, img itself when it has no replica */
+    int32_t k;
+
+    for (k = 0; k < ReplicaCount; k++)
+    {
+        if (Replicas[k].data == img->data)
+            return &Replicas[k].copies[ThreadNodeOf(omp_get_thread_num())];
+    }
+    return img;
+}
+
+static void RowSplit(int32_t h, int32_t nthreads, int32_t t, int32_t *r0, int32_t *r1)
+{
+    /* Rows of thread t under the default static schedule of an omp for over h rows */
+    int32_t q = h / nthreads, rem = h % nthreads;
+
+    *r0 = t * q + (t < rem ? t : rem);
+    *r1 = *r0 + q + (t < rem);
+}
+
+void NumaReport(const char *name, const uint8_t *data, uint32_t stride, uint32_t h)
+{
+    /*
+     * Share of the pages of its static row split that every thread finds on its own
+     * node, for the map or image whose interior starts at data; replicated images are
+     * measured on the copy the thread reads.
+     */
+    int32_t nthreads = ThreadCount > 0 ? ThreadCount : 1;
+    long page = sysconf(_SC_PAGESIZE);
+    int64_t local = 0, remote = 0, absent = 0;
+    int32_t t, k;
+
+    for (t = 0; t < nthreads; t++)
+    {
+        const uint8_t *base = data;
+        int32_t r0, r1, npages, node = ThreadNodeOf(t);
+        uintptr_t first, last;
+        void **pages;
+        int32_t *status;
+
+        for (k = 0; k < ReplicaCount; k++)
+        {
+            if (Replicas[k].data == data)
+                base = Replicas[k].copies[node].data;
+        }
+        RowSplit(h, nthreads, t, &r0, &r1);
+        if (r1 <= r0)
+            continue;
+        first = (uintptr_t)(base + (size_t)r0 * stride) / page;
+        last = (uintptr_t)(base + (size_t)r1 * stride - 1) / page;
+        npages = last - first + 1;
+        pages = (void **)malloc(npages * sizeof(void *));
+        status = (int32_t *)malloc(npages * sizeof(int32_t));
+        for (k = 0; k < npages; k++)
+        {
+            pages[k] = (void *)((first + k) * page);
+            status[k] = 0; // Single node when the query is not available
+        }
+#ifdef __linux__
+        syscall(SYS_move_pages, 0, npages, pages, NULL, status, 0);
+#endif
+        for (k = 0; k < npages; k++)
+        {
+            if (status[k] < 0)
+                absent++;
+            else if (status[k] == node)
+                local++;
+            else
+                remote++;
+        }
+        free(pages);
+        free(status);
+    }
+
+    printf("%s: %.1f%% local pages (%lld local, %lld remote, %lld not mapped)\n", name,
+           local + remote > 0 ? 100.0 * local / (local + remote) : 100.0, (long long)local, (long long)remote, (long long)absent);
+}
+
+void NumaRelease(void)
+{
+    int32_t k, n;
+
+    for (k = 0; k < ReplicaCount; k++)
+    {
+        for (n = 0; n < NodeCount; n++)
+        {
+#ifdef __linux__
+            munmap(Replicas[k].copies[n].buf, Replicas[k].size);
+#else
+            free(Replicas[k].copies[n].buf);
+#endif
+        }
+    }
+    ReplicaCount = 0;
+    free(ThreadNode);
+    ThreadNode = NULL;
+    ThreadCount = 0;
+}
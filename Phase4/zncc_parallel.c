@@ -7,8 +7,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <string.h>
+#include <unistd.h>
 #include "lodepng/lodepng.h"
 #include <sys/time.h> // For gettimeofday on Linux
+#include "zncc.h"
+#include "stereo.h"
 
 #define MAXDISP 65 // Maximum disparity (downscaled)
 #define MINDISP 0
@@ -20,6 +24,30 @@
 
 #define NEIBSIZE 256 // Size of the neighborhood for occlusion-filling
 
+#define RADIUS 2 // Disparities searched on each side of the coarse estimate in pyramid mode
+
+#define GRAPH_BAND 4 // Rows per task of the LR/RL/cross-check task graph
+
+#define PIPE_BAND 16 // Rows per band of the dataflow pipeline, raised to bsy / 2 if needed
+#define PIPE_RING 4  // Bands held by the grayscale ring buffers of the pipeline
+
+// Disparity engines selectable with -e
+static const struct
+{
+    const char *name;
+    ZNCCEngine fn;
+} Engines[] = {
+    {"naive", CALCZNCC},   // Direct window sums for every pixel and disparity
+    {"sat", CALCZNCC_SAT}, // Window statistics from integral images
+    {"box", CALCZNCC_BOX}, // Sliding box filter of L * R per disparity plane, O(1) per pixel and disparity
+    {"simd", CALCZNCC_SIMD}, // Vectorized cross term, widest of SSE4.1/AVX2/AVX-512 picked at startup
+    {"int", CALCZNCC_INT},   // Exact integer scores compared by cross-multiplication, no sqrt or division
+    {"spec", CALCZNCC_SPEC}, // Compiled for the window size and disparity count, generic fallback otherwise
+    {"tile", CALCZNCC_TILE}, // Cache-sized blocks of rows x columns x disparities, sizes probed at startup
+    {"patchmatch", CALCZNCC_PATCHMATCH}, // Random init + propagation + random refinement, for large disparity ranges
+    {"hybrid", CALCZNCC_HYBRID}, // OpenCL device and host threads on a row split that follows their throughput
+};
+
 // Function to read image
 uint8_t *ReadImage(const char *filename, uint32_t *width, uint32_t *height)
 {
@@ -45,39 +73,49 @@ void WriteImage(const char *filename, const uint8_t *image, uint32_t width, uint
     }
 }
 
-void resizegray(const uint8_t *imageL, const uint8_t *imageR, uint8_t *resizedL, uint8_t *resizedR, uint32_t w, uint32_t h)
+// Function to write a 16-bit image, which PNG stores big-endian
+void WriteImage16(const char *filename, const uint16_t *image, uint32_t width, uint32_t height)
 {
-    /* Downscaling and conversion to 8bit grayscale image */
-
-    int32_t i, j;     // Indices of the resized image
-    int32_t new_w = w / 4, new_h = h / 4; // Width and height of the downscaled image
-    int32_t orig_i, orig_j;               // Indices of the original image
+    uint8_t *bytes = (uint8_t *)malloc((size_t)width * height * 2);
+    uint32_t error;
+    size_t k;
 
-    // Iterating through the pixels of the downscaled image
-    for (i = 0; i < new_h; i++)
+    for (k = 0; k < (size_t)width * height; k++)
     {
-        for (j = 0; j < new_w; j++)
-        {
-            // Calculating corresponding indices in the original image
-            orig_i = (4 * i - 1 * (i > 0));
-            orig_j = (4 * j - 1 * (j > 0));
-            // Grayscaling
-            resizedL[i * new_w + j] = 0.2126 * imageL[orig_i * (4 * w) + 4 * orig_j] + 0.7152 * imageL[orig_i * (4 * w) + 4 * orig_j + 1] + 0.0722 * imageL[orig_i * (4 * w) + 4 * orig_j + 2];
-            resizedR[i * new_w + j] = 0.2126 * imageR[orig_i * (4 * w) + 4 * orig_j] + 0.7152 * imageR[orig_i * (4 * w) + 4 * orig_j + 1] + 0.0722 * imageR[orig_i * (4 * w) + 4 * orig_j + 2];
-        }
+        bytes[2 * k] = image[k] >> 8;
+        bytes[2 * k + 1] = image[k] & 0xFF;
     }
+    error = lodepng_encode_file(filename, bytes, width, height, LCT_GREY, 16);
+    if (error)
+    {
+        printf("Error %u: %s\n", error, lodepng_error_text(error));
+    }
+    free(bytes);
 }
 
-uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_t h, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+typedef struct
+{
+    const PaddedImage *left, *right;
+    int32_t bsx, bsy, mind, maxd;
+    uint8_t *dmap;
+} ZNCCJob;
+
+static void CALCZNCCTile(void *arg, int32_t r0, int32_t r1, int32_t c0, int32_t c1)
 {
-    /* Disparity map computation */
-    int32_t imsize = w * h; // Size of the image
+    /* Disparity map computation over rows [r0, r1) x columns [c0, c1) */
+    const ZNCCJob *job = (const ZNCCJob *)arg;
+    const PaddedImage *left = NumaLocal(job->left), *right = NumaLocal(job->right); // Copies on this thread's node with -r
+    int32_t bsx = job->bsx, bsy = job->bsy, mind = job->mind, maxd = job->maxd;
+    int32_t w = left->w, h = left->h; // Size of the image
+    int32_t stride = left->stride;    // Row pitch of both images
     int32_t bsize = bsx * bsy; // Block size
 
-    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    uint8_t *dmap = job->dmap;
     int32_t i, j;     // Indices for rows and colums respectively
     int32_t i_b, j_b; // Indices within the block
-    int32_t ind_l, ind_r; // Indices of block values within the whole image
+    int32_t ib0, ib1; // Rows of the block inside the image, [ib0, ib1)
+    int32_t jb0, jb1; // Columns of the block inside both images, [jb0, jb1)
+    const uint8_t *lrow, *rrow; // Rows of the block in the left and right images
     int32_t d;             // Disparity value
     float cl, cr;          // centered values of a pixel in the left and right images;
 
@@ -87,35 +125,43 @@ uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_
 
     int32_t best_d;
     float best_score;
-    #pragma omp parallel for private(i, j, i_b, j_b, ind_l, ind_r, d, lbmean, rbmean, lbstd, rbstd, current_score, best_d, best_score, cl, cr) shared(left, right, dmap)
 
-    for (i = 0; i < h; i++)
+    for (i = r0; i < r1; i++)
     {
-        for (j = 0; j < w; j++)
+        // Borders checking, once per row instead of once per tap
+        ib0 = -i > -bsy / 2 ? -i : -bsy / 2;
+        ib1 = h - i < bsy / 2 ? h - i : bsy / 2;
+        for (j = c0; j < c1; j++)
         {
             // Searching for the best d for the current pixel
             best_d = maxd;
             best_score = -1;
             for (d = mind; d <= maxd; d++)
             {
+                // Borders checking, once per disparity: the taps inside both images
+                jb0 = -bsx / 2;
+                if (j + jb0 < 0)
+                    jb0 = -j;
+                if (j + jb0 - d < 0)
+                    jb0 = d - j;
+                jb1 = bsx / 2;
+                if (j + jb1 > w)
+                    jb1 = w - j;
+                if (j + jb1 - d > w)
+                    jb1 = w + d - j;
+
                 // Calculating the blocks' means
                 lbmean = 0;
                 rbmean = 0;
-                for (i_b = -bsy / 2; i_b < bsy / 2; i_b++)
+                for (i_b = ib0; i_b < ib1; i_b++)
                 {
-                    for (j_b = -bsx / 2; j_b < bsx / 2; j_b++)
+                    lrow = left->data + (i + i_b) * stride + j;
+                    rrow = right->data + (i + i_b) * stride + j - d;
+                    for (j_b = jb0; j_b < jb1; j_b++)
                     {
-                        // Borders checking
-                        if (!(i + i_b >= 0) || !(i + i_b < h) || !(j + j_b >= 0) || !(j + j_b < w) || !(j + j_b - d >= 0) || !(j + j_b - d < w))
-                        {
-                            continue;
-                        }
-                        // Calculatiing indices of the block within the whole image
-                        ind_l = (i + i_b) * w + (j + j_b);
-                        ind_r = (i + i_b) * w + (j + j_b - d);
                         // Updating the blocks' means
-                        lbmean += left[ind_l];
-                        rbmean += right[ind_r];
+                        lbmean += lrow[j_b];
+                        rbmean += rrow[j_b];
                     }
                 }
                 lbmean /= bsize;
@@ -127,21 +173,14 @@ uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_
                 current_score = 0;
 
                 // Calculating the nomentaor and the standard deviations for the denominator
-                for (i_b = -bsy / 2; i_b < bsy / 2; i_b++)
+                for (i_b = ib0; i_b < ib1; i_b++)
                 {
-                    for (j_b = -bsx / 2; j_b < bsx / 2; j_b++)
+                    lrow = left->data + (i + i_b) * stride + j;
+                    rrow = right->data + (i + i_b) * stride + j - d;
+                    for (j_b = jb0; j_b < jb1; j_b++)
                     {
-                        // Borders checking
-                        if (!(i + i_b >= 0) || !(i + i_b < h) || !(j + j_b >= 0) || !(j + j_b < w) || !(j + j_b - d >= 0) || !(j + j_b - d < w))
-                        {
-                            continue;
-                        }
-                        // Calculatiing indices of the block within the whole image
-                        ind_l = (i + i_b) * w + (j + j_b);
-                        ind_r = (i + i_b) * w + (j + j_b - d);
-
-                        cl = left[ind_l] - lbmean;
-                        cr = right[ind_r] - rbmean;
+                        cl = lrow[j_b] - lbmean;
+                        cr = rrow[j_b] - rbmean;
                         lbstd += cl * cl;
                         rbstd += cr * cr;
                         current_score += cl * cr;
@@ -159,94 +198,294 @@ uint8_t *CALCZNCC(const uint8_t *left, const uint8_t *right, uint32_t w, uint32_
             dmap[i * w + j] = (uint8_t)abs(best_d); // Considering both Left to Right and Right to left disparities
         }
     }
-
-    return dmap;
 }
 
-void normalize_dmap(uint8_t *arr, uint32_t w, uint32_t h)
+uint8_t *CALCZNCC(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
 {
-    uint8_t max = 0;
-    uint8_t min = UCHAR_MAX;
-    int32_t imsize = w * h;
-    uint32_t i;
-    for (i = 0; i < imsize; i++)
-    {
-        if (arr[i] > max)
-            max = arr[i];
-        if (arr[i] < min)
-            min = arr[i];
-    }
+    /* Disparity map computation, the tiles are spread over the threads by RunTiles */
+    ZNCCJob job;
 
-    for (i = 0; i < imsize; i++)
-    {
-        arr[i] = (uint8_t)(255 * (arr[i] - min) / (max - min));
-    }
+    job.left = left;
+    job.right = right;
+    job.bsx = bsx;
+    job.bsy = bsy;
+    job.mind = mind;
+    job.maxd = maxd;
+    job.dmap = (uint8_t *)malloc(left->w * left->h); // Memory allocation for the disparity map
+    RunTiles(left->w, left->h, CALCZNCCTile, &job);
+
+    return job.dmap;
 }
 
-uint8_t *CrossCheck(const uint8_t *map1, const uint8_t *map2, uint32_t imsize, uint32_t dmax, uint32_t threshold)
+
+void CALCZNCC_GRAPH(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t maxd, uint32_t threshold,
+                    uint8_t **dmapLR, uint8_t **dmapRL, PaddedImage *checked)
 {
-    uint8_t *map = (uint8_t *)malloc(imsize);
-    uint32_t idx;
+    /*
+     * LR pass, RL pass and cross-check as one task graph over bands of GRAPH_BAND rows:
+     * no barrier between the passes, so threads done with LR bands go on with RL bands,
+     * and the cross-check of a band runs as soon as its LR and RL bands are computed.
+     */
+    int32_t w = left->w, h = left->h;
+    int32_t nbands = (h + GRAPH_BAND - 1) / GRAPH_BAND;
+    char *lr_done = (char *)malloc(nbands); // Dependency tokens of the bands
+    char *rl_done = (char *)malloc(nbands);
+    ZNCCJob jobLR, jobRL;
+    int32_t b;
+
+    jobLR.left = left;
+    jobLR.right = right;
+    jobLR.bsx = bsx;
+    jobLR.bsy = bsy;
+    jobLR.mind = MINDISP;
+    jobLR.maxd = maxd;
+    jobLR.dmap = (uint8_t *)malloc(w * h);
+    jobRL = jobLR;
+    jobRL.left = right;
+    jobRL.right = left;
+    jobRL.mind = -maxd;
+    jobRL.maxd = MINDISP;
+    jobRL.dmap = (uint8_t *)malloc(w * h);
 
-    for (idx = 0; idx < imsize; idx++)
+    #pragma omp parallel
+    #pragma omp single
     {
-        if (abs((int32_t)map1[idx] - map2[idx]) > threshold) // Remember about the trick for Rigth to left disprity in zncc!!
-            map[idx] = 0;
-        else
-            map[idx] = map1[idx];
+        // Created band by band, so the first cross-checks are ready early
+        for (b = 0; b < nbands; b++)
+        {
+            int32_t r0 = b * GRAPH_BAND;
+            int32_t r1 = r0 + GRAPH_BAND < h ? r0 + GRAPH_BAND : h;
+
+            #pragma omp task firstprivate(r0, r1) depend(out : lr_done[b])
+            CALCZNCCTile(&jobLR, r0, r1, 0, w);
+            #pragma omp task firstprivate(r0, r1) depend(out : rl_done[b])
+            CALCZNCCTile(&jobRL, r0, r1, 0, w);
+            #pragma omp task firstprivate(r0, r1) depend(in : lr_done[b], rl_done[b])
+            CrossCheckRows(jobLR.dmap, jobRL.dmap, checked, threshold, r0, r1);
+        }
     }
-    return map;
+
+    free(lr_done);
+    free(rl_done);
+    *dmapLR = jobLR.dmap;
+    *dmapRL = jobRL.dmap;
 }
 
-uint8_t *OcclusionFill(const uint8_t *map, uint32_t w, uint32_t h, uint32_t nsize)
+static inline int32_t BandClamp(int32_t b, int32_t nbands)
 {
-    int32_t imsize = w * h; // Size of the image
+    /* Band index clamped to [0, nbands], for the iterator bounds of the task dependences */
+    return b < 0 ? 0 : (b > nbands ? nbands : b);
+}
 
-    uint8_t *result = (uint8_t *)malloc(imsize);
-    int32_t i, j;     // Indices for rows and colums respectively
-    int32_t i_b, j_b; // Indices within the block
-    int32_t ind_neib; // Index in the nighbourhood
-    int32_t ext;
-    bool stop; // Stop flag for nearest neighbor interpolation
+bool BandPipeline(const uint8_t *imageL, const uint8_t *imageR, uint32_t w, uint32_t h, int32_t bsx, int32_t bsy, int32_t maxd,
+                  uint32_t threshold, uint32_t nsize, uint8_t **dmapLR, uint8_t **dmapRL, uint8_t **disparity)
+{
+    /*
+     * Resize, LR and RL maps (CALCZNCC_SIMD), cross-check, occlusion fill and
+     * normalization of the w x h downscaled pair as a dataflow graph of tasks over
+     * bands of rows. A band moves downstream as soon as the bands it depends on are
+     * ready: its neighbours within bsy / 2 rows for the maps, within nsize / 2 rows
+     * for the fill. The grayscale images and the cross-checked map only live in ring
+     * buffers of a few bands; a task overwriting a slot of a ring also waits for the
+     * readers of the band that held it. The LR, RL and final maps are the outputs
+     * and stay full-frame; the min and max of the fill bands make normalization a
+     * single rescale at the end.
+     */
+    int32_t band = PIPE_BAND > bsy / 2 ? PIPE_BAND : bsy / 2;
+    int32_t nbands = (h + band - 1) / band;
+    int32_t half = nsize / 2;
+    int32_t reach = (half + band - 1) / band; // Bands on each side read by the fill of a band
+    int32_t gring = PIPE_RING * band;         // Rows of the grayscale rings, stored twice
+    int32_t cring = (2 * reach + 2) * band;   // Rows of the cross-checked ring
+    PaddedImage grayL, grayR, checked;
+    char *g_done, *z_done, *c_done, *f_done; // Dependency tokens of the bands, per stage
+    uint8_t *bmin, *bmax;                    // Min and max of every filled band
+    uint8_t *lr, *rl, *out;
+    uint8_t min = UCHAR_MAX, max = 0;
+    int32_t s, b;
+
+    // Twice the rows in the grayscale rings, so that any window of gring rows is contiguous
+    if (!AllocPaddedImage(&grayL, w, 2 * gring, ZNCCKernelHalo(bsx, maxd)) || !AllocPaddedImage(&grayR, w, 2 * gring, ZNCCKernelHalo(bsx, maxd)) ||
+        !AllocPaddedImage(&checked, w, cring, half))
+    {
+        printf("Out of memory\n");
+        return false;
+    }
+    g_done = (char *)malloc(nbands);
+    z_done = (char *)malloc(nbands);
+    c_done = (char *)malloc(nbands);
+    f_done = (char *)malloc(nbands);
+    bmin = (uint8_t *)malloc(nbands);
+    bmax = (uint8_t *)malloc(nbands);
+    lr = (uint8_t *)malloc(w * h);
+    rl = (uint8_t *)malloc(w * h);
+    out = (uint8_t *)malloc(w * h);
 
-    for (i = 0; i < h; i++)
+    #pragma omp parallel
+    #pragma omp single
     {
-        for (j = 0; j < w; j++)
+        // Step s creates the resize of band s, the maps and cross-check of band s - 1 and the fill of band s - 1 - reach
+        for (s = 0; s < nbands + reach + 1; s++)
         {
-            // If the value of the pixel is zero, perform the occlusion filling by nearest neighbour interpolation
-            result[i * w + j] = map[i * w + j];
-            if (map[i * w + j] == 0)
+            b = s;
+            if (b < nbands)
+            {
+                // Overwrites the rows of band b - PIPE_RING, read by the maps of bands b - PIPE_RING - 1 to b - PIPE_RING + 1
+                #pragma omp task firstprivate(b) depend(out : g_done[b]) \
+                    depend(iterator(t = BandClamp(b - PIPE_RING - 1, nbands) : BandClamp(b - PIPE_RING + 2, nbands)), in : z_done[t])
+                {
+                    int32_t i;
+
+                    for (i = b * band; i < (b + 1) * band && i < h; i++)
+                    {
+                        uint8_t *rowL = grayL.data + (i % gring) * grayL.stride;
+                        uint8_t *rowR = grayR.data + (i % gring) * grayR.stride;
+                        resizegray_row(imageL, imageR, rowL, rowR, 4 * w, i);
+                        memcpy(rowL + gring * grayL.stride, rowL, w);
+                        memcpy(rowR + gring * grayR.stride, rowR, w);
+                    }
+                }
+            }
+
+            b = s - 1;
+            if (b >= 0 && b < nbands)
             {
+                #pragma omp task firstprivate(b) depend(out : z_done[b]) depend(iterator(t = BandClamp(b - 1, nbands) : BandClamp(b + 2, nbands)), in : g_done[t])
+                {
+                    // Rows of the windows of the band, a contiguous view of the rings
+                    int32_t r0 = b * band - bsy / 2 > 0 ? b * band - bsy / 2 : 0;
+                    int32_t r1 = (b + 1) * band + bsy / 2 < h ? (b + 1) * band + bsy / 2 : h;
+                    int32_t i1 = (b + 1) * band < h ? (b + 1) * band : h;
+                    PaddedImage viewL = grayL, viewR = grayR;
+                    IntegralImage iil, iir;
+                    double *best_score = (double *)malloc(w * sizeof(double));
+                    int32_t *best_d = (int32_t *)malloc(w * sizeof(int32_t));
+
+                    viewL.data += (r0 % gring) * grayL.stride;
+                    viewR.data += (r0 % gring) * grayR.stride;
+                    viewL.h = r1 - r0;
+                    viewR.h = r1 - r0;
+                    BuildIntegralImage(&iil, &viewL);
+                    BuildIntegralImage(&iir, &viewR);
+                    ZNCCSimdRows(&viewL, &viewR, &iil, &iir, r0, h, b * band, i1, bsx, bsy, MINDISP, maxd, best_score, best_d, lr, NULL, NULL);
+                    ZNCCSimdRows(&viewR, &viewL, &iir, &iil, r0, h, b * band, i1, bsx, bsy, -maxd, MINDISP, best_score, best_d, rl, NULL, NULL);
+                    FreeIntegralImage(&iil);
+                    FreeIntegralImage(&iir);
+                    free(best_score);
+                    free(best_d);
+                }
 
-                // Spreading search of non-zero pixel in the neighborhood i,j
-                stop = false;
-                for (ext = 1; (ext <= nsize / 2) && (!stop); ext++)
+                // Overwrites the rows of band b - cring / band, read by the fills of the bands within reach of it
+                #pragma omp task firstprivate(b) depend(in : z_done[b]) depend(out : c_done[b]) \
+                    depend(iterator(t = BandClamp(b - cring / band - reach, nbands) : BandClamp(b - cring / band + reach + 1, nbands)), in : f_done[t])
+                {
+                    int32_t i;
+
+                    for (i = b * band; i < (b + 1) * band && i < h; i++)
+                        CrossCheckRow(lr + i * w, rl + i * w, checked.data + (i % cring) * checked.stride, w, threshold);
+                }
+            }
+
+            b = s - 1 - reach;
+            if (b >= 0 && b < nbands)
+            {
+                #pragma omp task firstprivate(b) depend(out : f_done[b]) depend(iterator(t = BandClamp(b - reach, nbands) : BandClamp(b + reach + 1, nbands)), in : c_done[t])
                 {
-                    for (j_b = -ext; (j_b <= ext) && (!stop); j_b++)
+                    // Ring rows of the image rows within reach of the band, which may wrap around
+                    const uint8_t **rows = (const uint8_t **)malloc((band + 2 * half) * sizeof(uint8_t *));
+                    int32_t first = b * band - half; // Image row of rows[0]
+                    uint8_t bandmin = UCHAR_MAX, bandmax = 0;
+                    int32_t i, j;
+
+                    for (i = first; i < (b + 1) * band + half; i++)
+                    {
+                        if (i >= 0 && i < h)
+                            rows[i - first] = checked.data + (i % cring) * checked.stride;
+                    }
+                    for (i = b * band; i < (b + 1) * band && i < h; i++)
                     {
-                        for (i_b = -ext; (i_b <= ext) && (!stop); i_b++)
+                        for (j = 0; j < w; j++)
                         {
-                            // Cehcking borders
-                            if (!(i + i_b >= 0) || !(i + i_b < h) || !(j + j_b >= 0) || !(j + j_b < w) || (i_b == 0 && j_b == 0))
-                            {
-                                continue;
-                            }
-                            // Calculatiing indices of the block within the whole image
-                            ind_neib = (i + i_b) * w + (j + j_b);
-                            //If we meet a nonzero pixel, we interpolate and quite from this loop
-                            if (map[ind_neib] != 0)
-                            {
-                                result[i * w + j] = map[ind_neib];
-                                stop = true;
-                                break;
-                            }
+                            uint8_t v = rows[i - first][j];
+                            if (v == 0)
+                                v = FillPixel(rows + (i - first), j, -i, h - 1 - i, nsize);
+                            out[i * w + j] = v;
+                            if (v < bandmin)
+                                bandmin = v;
+                            if (v > bandmax)
+                                bandmax = v;
                         }
                     }
+                    bmin[b] = bandmin;
+                    bmax[b] = bandmax;
+                    free(rows);
                 }
             }
         }
     }
-    return result;
+
+    for (b = 0; b < nbands; b++)
+    {
+        if (bmin[b] < min)
+            min = bmin[b];
+        if (bmax[b] > max)
+            max = bmax[b];
+    }
+    rescale_dmap(out, w * h, min, max);
+
+    free(g_done);
+    free(z_done);
+    free(c_done);
+    free(f_done);
+    free(bmin);
+    free(bmax);
+    FreePaddedImage(&grayL);
+    FreePaddedImage(&grayR);
+    FreePaddedImage(&checked);
+    *dmapLR = lr;
+    *dmapRL = rl;
+    *disparity = out;
+    return true;
+}
+
+static double WallTime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void Usage(const char *prog)
+{
+    uint32_t k;
+    printf("Usage: %s [-e engine] [-f] [-g] [-b] [-c frames] [-m workers] [-u] [-o fill] [-P] [-M radius] [-C] [-S] [-n] [-a cpus] [-r] [-x bsx] [-y bsy] [-d maxdisp] [-p levels] [-k radius] [-s schedule] [-t tile]\n", prog);
+    printf("  -e engine   disparity engine:");
+    for (k = 0; k < sizeof(Engines) / sizeof(Engines[0]); k++)
+        printf(" %s", Engines[k].name);
+    printf(" (default %s)\n", Engines[0].name);
+    printf("  -f          fused mode: LR and RL maps from a single sweep (overrides -e)\n");
+    printf("  -g          graph mode: naive LR, RL and cross-check bands as one task graph (overrides -e)\n");
+    printf("  -b          band pipeline: every stage as a dataflow graph over row bands, simd maps (overrides -e)\n");
+    printf("  -c frames   stream mode: the pair processed frames times by a StereoContext (simd maps, overrides -e)\n");
+    printf("  -m workers  multi-process mode: simd LR and RL maps from worker processes over row bands, images in shared memory (overrides -e)\n");
+    printf("  -u          autotune the engine on this pair: threads, then the scheduler of naive (-s/-t), the row schedule of simd or the block sizes of tile;\n"
+           "              saved for this host, size, window, range and engine (not with -f, -g, -b, -c, -m or -p, which replace the engine)\n");
+    printf("  -o fill     occlusion fill: ring (linear-time distance transform, same result as search, default), sweep (same, ties left to the sweeps) or search (growing squares); -b and -c always search\n");
+    printf("  -P          fused post-processing: cross-check, fill and normalization in one pass over the LR and RL maps (ring or sweep fill)\n");
+    printf("  -M radius   median filter of the final map over (2 radius + 1)^2 windows: sorting networks for 1 and 2, constant-time histograms above\n");
+    printf("  -C          confidence map of the LR pass from its second peak, in confidence.png (simd maps, overrides -e)\n");
+    printf("  -S          sub-pixel LR map from a parabola through the best score and its neighbours, in 1/%d px in the 16-bit depthmap_subpixel.png (simd maps, overrides -e)\n", SUBPIXEL_SCALE);
+    printf("  -n          NUMA report: node of every thread and share of node-local pages of the images and maps\n");
+    printf("  -a cpus     pins thread k to the k-th CPU of the list, e.g. 0-7,16-23 (implies -n)\n");
+    printf("  -r          replicates the resized images on every node for the naive and simd engines (implies -n)\n");
+    printf("  -x bsx      window width (default %d)\n", BSX);
+    printf("  -y bsy      window height (default %d)\n", BSY);
+    printf("  -d maxdisp  maximum disparity (default %d), at the coarsest level with -p\n", MAXDISP);
+    printf("  -p levels   coarse-to-fine mode: full-resolution maps from a pyramid of levels images (the coarsest is 1/2^(levels-1))\n");
+    printf("  -k radius   disparities searched on each side of the coarse estimate with -p (default %d)\n", RADIUS);
+    printf("  -s schedule scheduler of the naive engine: steal (work-stealing 2D tiles, default) or static (omp for over rows)\n");
+    printf("  -t tile     initial tile size of the steal scheduler (default %d)\n", Sched.tile);
 }
 
 int32_t main(int32_t argc, char **argv)
@@ -259,16 +498,220 @@ int32_t main(int32_t argc, char **argv)
     uint8_t *OriginalImageR; // Right image
     uint8_t *DisparityLR;
     uint8_t *DisparityRL;
-    uint8_t *DisparityLRCC;
+    PaddedImage DisparityLRCC;
     uint8_t *Disparity;
-    uint8_t *ImageL; // Left image
-    uint8_t *ImageR; // Right image
+    PaddedImage ImageL; // Left image
+    PaddedImage ImageR; // Right image
+    uint8_t *Packed;
 
     uint32_t Width, Height;
     uint32_t w1, h1;
     uint32_t w2, h2;
     struct timeval start_time, end_time; // Variables to hold start and end timestamps
-  
+    ZNCCEngine engine = Engines[0].fn;
+    bool fused = false;
+    bool graph = false;
+    bool fusedpost = false; // Cross-check, fill and normalization through PostProcess
+    bool fillset = false;   // -o given, which the band pipeline and the library do not follow
+    bool pipeline = false;
+    int32_t frames = 0; // Stream mode through the library when > 0
+    int32_t workers = 0; // Multi-process mode when > 0
+    bool confidence = false, subpixel = false;
+    ZNCCExtra extra = {NULL, NULL}; // Maps computed along the LR map
+    bool tune = false;
+    bool engineruns; // The -e engine computes the maps, or simd with -C and -S
+    TuneKey tunekey;
+    bool schedset = false; // -s or -t given, which a saved configuration does not override
+    TuneResult tuned;
+    char desc[128];
+    int32_t bsx = BSX, bsy = BSY, maxdisp = MAXDISP;
+    int32_t levels = 0, radius = RADIUS; // Pyramid mode when levels > 0
+    int32_t halo;
+    int32_t median = 0; // Median filter radius of the final map, none when 0
+    double t0, t_resize, t_maps, t_cc = 0, t_fill = 0, t_norm = 0, t_post = 0, t_median = 0, t_serial; // Stage times
+    int32_t opt;
+    uint32_t k;
+
+    // Parsing the command line
+    while ((opt = getopt(argc, argv, "e:fgbc:m:W:uo:PM:CSna:rx:y:d:p:k:s:t:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            for (k = 0; k < sizeof(Engines) / sizeof(Engines[0]); k++)
+            {
+                if (strcmp(optarg, Engines[k].name) == 0)
+                    break;
+            }
+            if (k == sizeof(Engines) / sizeof(Engines[0]))
+            {
+                printf("Unknown engine: %s\n", optarg);
+                Usage(argv[0]);
+                return -1;
+            }
+            engine = Engines[k].fn;
+            break;
+        case 'f':
+            fused = true;
+            break;
+        case 'g':
+            graph = true;
+            break;
+        case 'b':
+            pipeline = true;
+            break;
+        case 'c':
+            frames = atoi(optarg);
+            break;
+        case 'm':
+            workers = atoi(optarg);
+            break;
+        case 'W':
+            // Worker process of -m, started by the coordinator
+            return ShardWorker(optarg);
+        case 'u':
+            tune = true;
+            break;
+        case 'o':
+            if (strcmp(optarg, "sweep") == 0)
+                Fill = FILL_SWEEP;
+            else if (strcmp(optarg, "ring") == 0)
+                Fill = FILL_RING;
+            else if (strcmp(optarg, "search") == 0)
+                Fill = FILL_SEARCH;
+            else
+            {
+                printf("Unknown fill: %s\n", optarg);
+                Usage(argv[0]);
+                return -1;
+            }
+            fillset = true;
+            break;
+        case 'P':
+            fusedpost = true;
+            break;
+        case 'M':
+            median = atoi(optarg);
+            break;
+        case 'C':
+            confidence = true;
+            break;
+        case 'S':
+            subpixel = true;
+            break;
+        case 'n':
+            Numa.enabled = true;
+            break;
+        case 'a':
+            Numa.enabled = true;
+            Numa.affinity = optarg;
+            break;
+        case 'r':
+            Numa.enabled = true;
+            Numa.replicate = true;
+            break;
+        case 'x':
+            bsx = atoi(optarg);
+            break;
+        case 'y':
+            bsy = atoi(optarg);
+            break;
+        case 'd':
+            maxdisp = atoi(optarg);
+            break;
+        case 'p':
+            levels = atoi(optarg);
+            break;
+        case 'k':
+            radius = atoi(optarg);
+            break;
+        case 's':
+            if (strcmp(optarg, "static") == 0)
+                Sched.kind = SCHED_STATIC;
+            else if (strcmp(optarg, "steal") == 0)
+                Sched.kind = SCHED_STEAL;
+            else
+            {
+                printf("Unknown schedule: %s\n", optarg);
+                Usage(argv[0]);
+                return -1;
+            }
+            schedset = true;
+            break;
+        case 't':
+            Sched.tile = atoi(optarg);
+            schedset = true;
+            break;
+        default:
+            Usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (bsx < 2 || bsy < 2 || maxdisp < MINDISP || maxdisp > UCHAR_MAX)
+    {
+        printf("Invalid window size or disparity range\n");
+        return -1;
+    }
+    if (levels < 0 || levels > PYRAMID_MAX_LEVELS || radius < 0 || Sched.tile < 1)
+    {
+        printf("Invalid pyramid levels, radius or tile size\n");
+        return -1;
+    }
+    if (graph && (fused || levels > 0))
+    {
+        printf("-g cannot be combined with -f or -p\n");
+        return -1;
+    }
+    if (pipeline && (fused || graph || levels > 0))
+    {
+        printf("-b cannot be combined with -f, -g or -p\n");
+        return -1;
+    }
+    if (frames < 0 || (frames > 0 && (fused || graph || pipeline || levels > 0)))
+    {
+        printf("-c needs a positive number of frames and cannot be combined with -f, -g, -b or -p\n");
+        return -1;
+    }
+    if (workers < 0 || workers > SHARD_MAX_WORKERS || (workers > 0 && (fused || graph || pipeline || frames > 0 || levels > 0)))
+    {
+        printf("-m needs 1 to %d workers and cannot be combined with -f, -g, -b, -c or -p\n", SHARD_MAX_WORKERS);
+        return -1;
+    }
+    if (fusedpost && (graph || pipeline || frames > 0 || Fill == FILL_SEARCH))
+    {
+        printf("-P cannot be combined with -g, -b, -c or -o search\n");
+        return -1;
+    }
+    if (fillset && (pipeline || frames > 0))
+    {
+        printf("-o cannot be combined with -b or -c, which fill band by band with the search\n");
+        return -1;
+    }
+    if (median < 0 || median > MEDIAN_MAX_RADIUS || (median > 0 && (pipeline || frames > 0)))
+    {
+        printf("-M needs a radius up to %d and cannot be combined with -b or -c\n", MEDIAN_MAX_RADIUS);
+        return -1;
+    }
+    if ((confidence || subpixel) && (fused || graph || pipeline || frames > 0 || workers > 0 || levels > 0))
+    {
+        printf("-C and -S cannot be combined with -f, -g, -b, -c, -m or -p\n");
+        return -1;
+    }
+    if (confidence || subpixel)
+        engine = CALCZNCC_SIMD;
+    // The modes compute the maps without the -e engine: nothing of it to tune or to load
+    engineruns = !(fused || graph || pipeline || frames > 0 || workers > 0 || levels > 0);
+    if (tune && !engineruns)
+    {
+        printf("-u cannot be combined with -f, -g, -b, -c, -m or -p\n");
+        return -1;
+    }
+
+    // Pinning before anything is allocated, so that the first touches happen on the final nodes
+    if (Numa.enabled && !NumaSetup())
+        return -1;
+
     /// Reading the images into memory
     OriginalImageL = ReadImage(inputFilename1, &w1, &h1);
     OriginalImageR = ReadImage(inputFilename2, &w2, &h2);
@@ -285,52 +728,311 @@ int32_t main(int32_t argc, char **argv)
         return -1;
     }
 
-    Width = w1 / 4;
-    Height = h1 / 4;
+    // The pyramid works at full resolution, the single-scale search on the image downscaled by 4
+    Width = levels > 0 ? w1 : w1 / 4;
+    Height = levels > 0 ? h1 : h1 / 4;
+    // A disparity of the image width or more leaves no window inside both images
+    if (maxdisp >= (int32_t)(levels > 0 ? w1 >> (levels - 1) : Width))
+    {
+        printf("The maximum disparity must be smaller than the width of the %s image (%u)\n", levels > 0 ? "coarsest" : "resized",
+               levels > 0 ? w1 >> (levels - 1) : Width);
+        return -1;
+    }
+    if (fusedpost && (Width > FILL_MAX_SIZE || Height > FILL_MAX_SIZE))
+    {
+        printf("-P needs maps up to %d pixels on a side\n", FILL_MAX_SIZE);
+        return -1;
+    }
+    halo = levels > 0 ? ZNCCKernelHalo(bsx, maxdisp << (levels - 1) < UCHAR_MAX ? maxdisp << (levels - 1) : UCHAR_MAX) : ZNCCKernelHalo(bsx, maxdisp);
+    // Configuration saved by an earlier -u run on this host for this size, window, range and engine
+    tunekey.w = Width;
+    tunekey.h = Height;
+    tunekey.bsx = bsx;
+    tunekey.bsy = bsy;
+    tunekey.maxd = maxdisp;
+    for (k = 0; k + 1 < sizeof(Engines) / sizeof(Engines[0]) && Engines[k].fn != engine; k++)
+        ;
+    tunekey.engine = Engines[k].name;
+    if (!tune && engineruns && TuneLoad(&tunekey, &tuned))
+    {
+        if (schedset)
+            tuned.sched = Sched;
+        TuneApply(&tuned);
+        TuneFormat(&tuned, desc, sizeof(desc));
+        printf("Tuned configuration: %s\n", desc);
+    }
+    if (frames > 0)
+    {
+        // Every frame reuses the context: no allocation and a single parallel region per frame
+        StereoParams params = {bsx, bsy, maxdisp, THRESHOLD, NEIBSIZE, 0};
+        StereoContext *ctx;
+        const uint8_t *lr, *rl;
+        double first = 0, rest = 0;
+        int32_t f;
+
+        t0 = WallTime();
+        ctx = StereoCreate(w1, h1, &params);
+        if (!ctx)
+        {
+            printf("Could not create the stereo context\n");
+            return -1;
+        }
+        printf("Context created in %.6f seconds, using the %s kernel\n", WallTime() - t0, ZNCCSimdVariant());
+        Disparity = (uint8_t *)malloc(Width * Height);
+        for (f = 0; f < frames; f++)
+        {
+            t0 = WallTime();
+            StereoCompute(ctx, OriginalImageL, OriginalImageR, Disparity);
+            if (f == 0)
+                first = WallTime() - t0;
+            else
+                rest += WallTime() - t0;
+        }
+        printf("Frame time: first %.6f seconds", first);
+        if (frames > 1)
+            printf(", mean of the next %d %.6f seconds", frames - 1, rest / (frames - 1));
+        printf("\n");
+
+        // Copies of the raw maps, normalized for saving
+        StereoMaps(ctx, &lr, &rl);
+        DisparityLR = (uint8_t *)malloc(Width * Height);
+        DisparityRL = (uint8_t *)malloc(Width * Height);
+        memcpy(DisparityLR, lr, Width * Height);
+        memcpy(DisparityRL, rl, Width * Height);
+        normalize_dmap(DisparityLR, Width, Height);
+        normalize_dmap(DisparityRL, Width, Height);
+        WriteImage("depthmap_before_post_procLR.png", DisparityLR, Width, Height);
+        WriteImage("depthmap_before_post_procRL.png", DisparityRL, Width, Height);
+        WriteImage("depthmap.png", Disparity, Width, Height);
+
+        StereoDestroy(ctx);
+        free(OriginalImageR);
+        free(OriginalImageL);
+        free(Disparity);
+        free(DisparityLR);
+        free(DisparityRL);
+        return 0;
+    }
+
+    if (tune)
+    {
+        // On a pair of its own, so that the tuning stays out of the stage times
+        PaddedImage tuneL, tuneR;
+
+        if (!AllocPaddedImage(&tuneL, Width, Height, halo) || !AllocPaddedImage(&tuneR, Width, Height, halo))
+        {
+            printf("Out of memory\n");
+            return -1;
+        }
+        if (levels > 0)
+            grayscale(OriginalImageL, OriginalImageR, &tuneL, &tuneR);
+        else
+            resizegray(OriginalImageL, OriginalImageR, &tuneL, &tuneR, Width * 4, Height * 4);
+        tuned = Autotune(&tunekey, engine, &tuneL, &tuneR);
+        TuneApply(&tuned);
+        TuneFormat(&tuned, desc, sizeof(desc));
+        printf("Best configuration: %s%s\n", desc, TuneSave(&tunekey, &tuned) ? "" : " (could not be saved)");
+        FreePaddedImage(&tuneL);
+        FreePaddedImage(&tuneR);
+    }
+
     // Resizing
     gettimeofday(&start_time, NULL); // Record start time
 
-    ImageL = (uint8_t *)malloc(Width * Height); // Memory pre-allocation for the resized image
-    ImageR = (uint8_t *)malloc(Width * Height); // Memory pre-allocation for the resized image
-    resizegray(OriginalImageL, OriginalImageR, ImageL, ImageR, Width * 4, Height * 4); // Left Image
+    if (pipeline)
+    {
+        // The resized images and the cross-checked map only exist band by band, in the rings of the pipeline
+        printf("Running the band pipeline...\n");
+        printf("Using the %s kernel\n", ZNCCSimdVariant());
+        t0 = WallTime();
+        if (!BandPipeline(OriginalImageL, OriginalImageR, Width, Height, bsx, bsy, maxdisp, THRESHOLD, NEIBSIZE, &DisparityLR, &DisparityRL, &Disparity))
+            return -1;
+        gettimeofday(&end_time, NULL); // Record end time
+        t_maps = WallTime() - t0;
+        double algorithm_time = (end_time.tv_sec - start_time.tv_sec) +
+                                (end_time.tv_usec - start_time.tv_usec) / 1000000.0; // Calculate execution time
+
+        printf("Algorithm time: %.6f seconds\n", algorithm_time);
+        printf("Pipeline: %.6f seconds, serial fraction %.6f seconds (%.2f%%)\n", t_maps, algorithm_time - t_maps, 100.0 * (algorithm_time - t_maps) / algorithm_time);
+
+        normalize_dmap(DisparityLR, Width, Height);
+        normalize_dmap(DisparityRL, Width, Height);
+        WriteImage("depthmap_before_post_procLR.png", DisparityLR, Width, Height);
+        WriteImage("depthmap_before_post_procRL.png", DisparityRL, Width, Height);
+        WriteImage("depthmap.png", Disparity, Width, Height);
+
+        free(OriginalImageR);
+        free(OriginalImageL);
+        free(Disparity);
+        free(DisparityLR);
+        free(DisparityRL);
+        return 0;
+    }
+
+    // Memory pre-allocation for the resized images, with zero halos wide enough for the vector kernels at the borders
+    if (!AllocPaddedImage(&ImageL, Width, Height, halo) || !AllocPaddedImage(&ImageR, Width, Height, halo) ||
+        !AllocPaddedImage(&DisparityLRCC, Width, Height, NEIBSIZE / 2))
+    {
+        printf("Out of memory\n");
+        return -1;
+    }
+    t0 = WallTime();
+    if (levels > 0)
+        grayscale(OriginalImageL, OriginalImageR, &ImageL, &ImageR);
+    else
+        resizegray(OriginalImageL, OriginalImageR, &ImageL, &ImageR, Width * 4, Height * 4); // Left Image
+    t_resize = WallTime() - t0;
+    if (Numa.replicate && (!NumaReplicate(&ImageL) || !NumaReplicate(&ImageR)))
+    {
+        printf("Could not replicate the images\n");
+        return -1;
+    }
 
     // Calculating the disparity maps
+    if (!fused && (engine == CALCZNCC_SIMD || engine == CALCZNCC_INT || workers > 0))
+        printf("Using the %s kernel\n", ZNCCSimdVariant());
+    if (!fused && engine == CALCZNCC_SPEC)
+        printf("Using the %s %dx%d kernel\n", ZNCCSpecAvailable(bsx, bsy, MINDISP, maxdisp) ? "compiled" : "generic", bsx, bsy);
+    if (!fused && engine == CALCZNCC_TILE && levels == 0)
+    {
+        ZNCCTileProbe(&ImageL, &ImageR, bsx, bsy, MINDISP, maxdisp);
+        printf("Using %dx%d tiles, %d disparities per chunk\n", ZNCCTileConfig().cols, ZNCCTileConfig().rows, ZNCCTileConfig().chunk);
+    }
     printf("Computing maps with zncc...\n");
-    DisparityLR = CALCZNCC(ImageL, ImageR, Width, Height, BSX, BSY, MINDISP, MAXDISP);
-    DisparityRL = CALCZNCC(ImageR, ImageL, Width, Height, BSX, BSY, -MAXDISP, MINDISP);
-    // Cross-checking
-    printf("Performing cross-checking...\n");
-    DisparityLRCC = CrossCheck(DisparityLR, DisparityRL, Width * Height, MAXDISP, THRESHOLD);
-    // Occlusion-filling
-    printf("Performing occlusion-filling...\n");
-    Disparity = OcclusionFill(DisparityLRCC, Width, Height, NEIBSIZE);
-    // Normalization
-    printf("Performing maps normalization...\n");
-    normalize_dmap(Disparity, Width, Height);
+    t0 = WallTime();
+    if (levels > 0)
+    {
+        printf("Coarse-to-fine over %d levels, +/-%d disparities\n", levels, radius);
+        if (!CALCZNCC_PYRAMID(&ImageL, &ImageR, levels, fused ? NULL : engine, bsx, bsy, maxdisp, radius, &DisparityLR, &DisparityRL))
+            return -1;
+    }
+    else if (graph)
+    {
+        CALCZNCC_GRAPH(&ImageL, &ImageR, bsx, bsy, maxdisp, THRESHOLD, &DisparityLR, &DisparityRL, &DisparityLRCC);
+    }
+    else if (workers > 0)
+    {
+        printf("Sharding the maps over %d worker processes\n", workers);
+        if (!ShardMaps(&ImageL, &ImageR, bsx, bsy, maxdisp, workers, argv[0], &DisparityLR, &DisparityRL))
+            return -1;
+    }
+    else if (fused)
+    {
+        CALCZNCC_FUSED(&ImageL, &ImageR, bsx, bsy, MINDISP, maxdisp, &DisparityLR, &DisparityRL);
+    }
+    else if (confidence || subpixel)
+    {
+        // The second peak and the neighbours of the winner are tracked in the LR sweep itself
+        if (confidence)
+            extra.confidence = (uint8_t *)malloc(Width * Height);
+        if (subpixel)
+            extra.subpixel = (uint16_t *)malloc(Width * Height * sizeof(uint16_t));
+        DisparityLR = CALCZNCC_SIMD_EXTRA(&ImageL, &ImageR, bsx, bsy, MINDISP, maxdisp, &extra);
+        DisparityRL = engine(&ImageR, &ImageL, bsx, bsy, -maxdisp, MINDISP);
+    }
+    else
+    {
+        DisparityLR = engine(&ImageL, &ImageR, bsx, bsy, MINDISP, maxdisp);
+        DisparityRL = engine(&ImageR, &ImageL, bsx, bsy, -maxdisp, MINDISP);
+    }
+    t_maps = WallTime() - t0;
+    SchedReport();
+    if (engine == CALCZNCC_HYBRID)
+        HybridReport();
+    if (fusedpost)
+    {
+        // One pass from the LR and RL maps to the final map, reported as its own stage
+        void *scratch = malloc(PostProcessScratch(Width, Height)); // Reusable from frame to frame
+
+        printf("Performing fused cross-checking, occlusion-filling and normalization...\n");
+        Disparity = (uint8_t *)malloc(Width * Height);
+        t0 = WallTime();
+        PostProcess(DisparityLR, DisparityRL, Width, Height, THRESHOLD, NEIBSIZE, scratch, Disparity);
+        t_post = WallTime() - t0;
+        free(scratch);
+    }
+    else
+    {
+        // Cross-checking
+        printf("Performing cross-checking...\n");
+        t0 = WallTime();
+        if (!graph) // Already done band by band in the task graph
+            CrossCheck(DisparityLR, DisparityRL, &DisparityLRCC, maxdisp, THRESHOLD);
+        t_cc = WallTime() - t0;
+        // Occlusion-filling
+        printf("Performing occlusion-filling...\n");
+        t0 = WallTime();
+        Disparity = OcclusionFill(&DisparityLRCC, NEIBSIZE);
+        if (!Disparity)
+            return -1;
+        t_fill = WallTime() - t0;
+        // Normalization
+        printf("Performing maps normalization...\n");
+        t0 = WallTime();
+        normalize_dmap(Disparity, Width, Height);
+        t_norm = WallTime() - t0;
+    }
+    if (median > 0)
+    {
+        // Median of the final map, in place of a separate pass over the saved PNG
+        uint8_t *filtered;
+
+        printf("Performing %dx%d median filtering...\n", 2 * median + 1, 2 * median + 1);
+        t0 = WallTime();
+        filtered = MedianFilter(Disparity, Width, Height, median);
+        free(Disparity);
+        Disparity = filtered;
+        t_median = WallTime() - t0;
+    }
      gettimeofday(&end_time, NULL); // Record end time
     double algorithm_time = (end_time.tv_sec - start_time.tv_sec) +
                         (end_time.tv_usec - start_time.tv_usec) / 1000000.0; // Calculate execution time
 
     printf("Algorithm time: %.6f seconds\n", algorithm_time);
+    // Every stage runs in parallel: what is left outside them (allocations, messages) is serial
+    t_serial = algorithm_time - (t_resize + t_maps + t_cc + t_fill + t_norm + t_post + t_median);
+    printf("Stages: resize %.6f, maps %.6f, cross-check %.6f, fill %.6f, normalize %.6f, post %.6f, median %.6f seconds\n", t_resize, t_maps, t_cc,
+           t_fill, t_norm, t_post, t_median);
+    printf("Serial fraction: %.6f seconds (%.2f%%)\n", t_serial, 100.0 * t_serial / algorithm_time);
+
+    if (Numa.enabled)
+    {
+        NumaReport("ImageL", ImageL.data, ImageL.stride, Height);
+        NumaReport("ImageR", ImageR.data, ImageR.stride, Height);
+        NumaReport("DisparityLR", DisparityLR, Width, Height);
+        NumaReport("DisparityLRCC", DisparityLRCC.data, DisparityLRCC.stride, Height);
+        NumaReport("Disparity", Disparity, Width, Height);
+    }
 
     normalize_dmap(DisparityLR, Width, Height);
     normalize_dmap(DisparityRL, Width, Height);
 
     // Saving the results
-    WriteImage("resized_left.png", ImageL, Width, Height);
-    WriteImage("resized_right.png", ImageR, Width, Height);
+    Packed = PackImage(&ImageL);
+    WriteImage("resized_left.png", Packed, Width, Height);
+    free(Packed);
+    Packed = PackImage(&ImageR);
+    WriteImage("resized_right.png", Packed, Width, Height);
+    free(Packed);
     WriteImage("depthmap_before_post_procLR.png", DisparityLR, Width, Height);
     WriteImage("depthmap_before_post_procRL.png", DisparityRL, Width, Height);
     WriteImage("depthmap.png", Disparity, Width, Height);
+    if (extra.confidence)
+        WriteImage("confidence.png", extra.confidence, Width, Height);
+    if (extra.subpixel)
+        WriteImage16("depthmap_subpixel.png", extra.subpixel, Width, Height);
 
     free(OriginalImageR);
     free(OriginalImageL);
-    free(ImageR);
-    free(ImageL);
+    FreePaddedImage(&ImageR);
+    FreePaddedImage(&ImageL);
     free(Disparity);
     free(DisparityLR);
     free(DisparityRL);
-    free(DisparityLRCC);
+    free(extra.confidence);
+    free(extra.subpixel);
+    FreePaddedImage(&DisparityLRCC);
+    NumaRelease();
 
     return 0;
 }
@@ -0,0 +1,167 @@
+#include "zncc.h"
+
+#define PM_ITERATIONS 4 // Propagation + refinement sweeps, ZNCC_PM_ITERS overrides it
+
+/*
+ * PatchMatch-style search: every pixel starts from a random disparity, then each
+ * sweep offers it the disparities of its four neighbours (propagation) and random
+ * disparities in windows halving down to +/-1 around its current one (refinement).
+ * A sweep updates the pixels of one colour of a checkerboard at a time, so the
+ * neighbours read during the update are never written concurrently. The number of
+ * scores per pixel grows with the log of the disparity range only.
+ */
+
+typedef struct
+{
+    const PaddedImage *left, *right;
+    const IntegralImage *iil, *iir;
+    int32_t bsx, bsy;
+} PMJob;
+
+static double PMScore(const PMJob *job, int32_t i, int32_t j, int32_t d)
+{
+    /* ZNCC of pixel (i, j) at disparity d, clipped like CALCZNCC; -1 when no tap is valid */
+    int32_t w = job->left->w, h = job->left->h;
+    int32_t bsx = job->bsx, bsy = job->bsy;
+    int32_t r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+    int32_t r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+    int32_t c0, c1;
+    int64_t n, sl, sr, sll, srr, slr;
+
+    c0 = j - bsx / 2;
+    if (c0 < 0)
+        c0 = 0;
+    if (c0 < d)
+        c0 = d;
+    c1 = j + bsx / 2;
+    if (c1 > w)
+        c1 = w;
+    if (c1 > w + d)
+        c1 = w + d;
+    if (c1 <= c0 || r1 <= r0)
+        return -1;
+
+    slr = CrossTermClipped(job->left->data, job->right->data, job->left->stride, r0, r1, c0, c1, d);
+    n = (int64_t)(r1 - r0) * (c1 - c0);
+    sl = RectSum(job->iil->sum, job->iil->stride, r0, r1, c0, c1);
+    sll = RectSum(job->iil->sqsum, job->iil->stride, r0, r1, c0, c1);
+    sr = RectSum(job->iir->sum, job->iir->stride, r0, r1, c0 - d, c1 - d);
+    srr = RectSum(job->iir->sqsum, job->iir->stride, r0, r1, c0 - d, c1 - d);
+    return ZNCCFromSums(n, bsx * bsy, sl, sr, sll, srr, slr);
+}
+
+static uint32_t PMRandom(uint32_t idx, uint32_t iter, uint32_t draw)
+{
+    /* Stateless hash of the pixel, sweep and draw numbers: reproducible with any thread count */
+    uint32_t x = idx * 0x9E3779B1u ^ (iter + 1) * 0x85EBCA77u ^ (draw + 1) * 0xC2B2AE3Du;
+
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return x;
+}
+
+uint8_t *CALCZNCC_PATCHMATCH(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    uint32_t w = left->w, h = left->h; // Size of the image
+    int32_t imsize = w * h;
+    int32_t ndisp = maxd - mind + 1;
+    const char *env = getenv("ZNCC_PM_ITERS");
+    int32_t iterations = env && atoi(env) > 0 ? atoi(env) : PM_ITERATIONS;
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    int32_t *best_d = (int32_t *)malloc(imsize * sizeof(int32_t));
+    double *best_score = (double *)malloc(imsize * sizeof(double));
+    IntegralImage iil, iir;
+    PMJob job;
+    int32_t i, iter, colour;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+    job.left = left;
+    job.right = right;
+    job.iil = &iil;
+    job.iir = &iir;
+    job.bsx = bsx;
+    job.bsy = bsy;
+
+    // Random initialization
+    #pragma omp parallel for
+    for (i = 0; i < imsize; i++)
+    {
+        best_d[i] = mind + PMRandom(i, 0, 0) % ndisp;
+        best_score[i] = PMScore(&job, i / w, i % w, best_d[i]);
+    }
+
+    for (iter = 1; iter <= iterations; iter++)
+    {
+        for (colour = 0; colour < 2; colour++)
+        {
+            #pragma omp parallel for schedule(dynamic, 4)
+            for (i = 0; i < h; i++)
+            {
+                int32_t j, k, d, radius, draw;
+                double s;
+
+                for (j = (i + colour) % 2; j < w; j += 2)
+                {
+                    int32_t idx = i * w + j;
+                    int32_t cand[4], ncand = 0;
+
+                    // Propagation from the four neighbours, all of the other colour
+                    if (j > 0)
+                        cand[ncand++] = best_d[idx - 1];
+                    if (j < w - 1)
+                        cand[ncand++] = best_d[idx + 1];
+                    if (i > 0)
+                        cand[ncand++] = best_d[idx - w];
+                    if (i < h - 1)
+                        cand[ncand++] = best_d[idx + w];
+                    for (k = 0; k < ncand; k++)
+                    {
+                        d = cand[k];
+                        if (d == best_d[idx])
+                            continue;
+                        s = PMScore(&job, i, j, d);
+                        if (s > best_score[idx] || (s == best_score[idx] && d < best_d[idx]))
+                        {
+                            best_score[idx] = s;
+                            best_d[idx] = d;
+                        }
+                    }
+
+                    // Random refinement in windows halving around the current disparity
+                    draw = 0;
+                    for (radius = ndisp / 2; radius >= 1; radius /= 2)
+                    {
+                        d = best_d[idx] + (int32_t)(PMRandom(idx, iter, ++draw) % (2 * radius + 1)) - radius;
+                        if (d < mind)
+                            d = mind;
+                        if (d > maxd)
+                            d = maxd;
+                        if (d == best_d[idx])
+                            continue;
+                        s = PMScore(&job, i, j, d);
+                        if (s > best_score[idx] || (s == best_score[idx] && d < best_d[idx]))
+                        {
+                            best_score[idx] = s;
+                            best_d[idx] = d;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < imsize; i++)
+        dmap[i] = (uint8_t)abs(best_d[i]); // Considering both Left to Right and Right to left disparities
+
+    free(best_d);
+    free(best_score);
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
@@ -0,0 +1,184 @@
+#include "zncc.h"
+
+void DownsampleImage(const PaddedImage *src, PaddedImage *dst)
+{
+    /* 2x2 box average into dst, allocated by the caller with half the size of src */
+    int32_t i, j;
+
+    #pragma omp parallel for private(j)
+    for (i = 0; i < dst->h; i++)
+    {
+        const uint8_t *row0 = src->data + (2 * i) * src->stride;
+        const uint8_t *row1 = row0 + src->stride;
+        uint8_t *out = dst->data + i * dst->stride;
+        for (j = 0; j < dst->w; j++)
+            out[j] = (row0[2 * j] + row0[2 * j + 1] + row1[2 * j] + row1[2 * j + 1] + 2) / 4;
+    }
+}
+
+uint8_t *CALCZNCC_REFINE(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, const uint8_t *coarse, uint32_t cw, uint32_t ch, int32_t sign, int32_t radius, int32_t maxd)
+{
+    /*
+     * Disparity map computation restricted, for every pixel, to the 2 * radius + 1
+     * disparities around twice the coarse estimate of its parent pixel. The coarse
+     * map holds |d|, sign (+1 for LR, -1 for RL) restores the direction and the
+     * search is clipped to [0, maxd] in magnitude.
+     */
+    int32_t w = left->w, h = left->h; // Size of the image, signed so that w + d is negative for d < -w
+    uint32_t stride = left->stride;    // Row pitch of both images
+    const uint8_t *ldata = left->data, *rdata = right->data;
+    int32_t imsize = w * h;
+    int32_t bsize = bsx * bsy; // Block size
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+    int32_t i;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel for shared(ldata, rdata, dmap, iil, iir)
+    for (i = 0; i < h; i++)
+    {
+        int32_t r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+        int32_t r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+        uint32_t ci = i / 2 < ch ? i / 2 : ch - 1; // Parent row in the coarse map
+        int32_t j, a, a0, a1, d;
+        int32_t c0, c1;
+        int32_t best_d;
+        int64_t n, sl, sr, sll, srr, slr;
+        double current_score, best_score;
+
+        for (j = 0; j < w; j++)
+        {
+            uint32_t cj = j / 2 < cw ? j / 2 : cw - 1;
+            int32_t guess = 2 * coarse[ci * cw + cj];
+
+            // maxd is capped at UCHAR_MAX, below twice the coarse range: keep [a0, a1] non-empty
+            if (guess > maxd)
+                guess = maxd;
+
+            // Magnitudes searched, in increasing order of the signed disparity
+            a0 = guess - radius > 0 ? guess - radius : 0;
+            a1 = guess + radius < maxd ? guess + radius : maxd;
+            best_d = sign > 0 ? a1 : -a0;
+            best_score = -1;
+
+            for (a = 0; a <= a1 - a0; a++)
+            {
+                d = sign > 0 ? a0 + a : -(a1 - a);
+
+                // Same taps as the border checks of CALCZNCC
+                c0 = j - bsx / 2;
+                if (c0 < 0)
+                    c0 = 0;
+                if (c0 < d)
+                    c0 = d;
+                c1 = j + bsx / 2;
+                if (c1 > w)
+                    c1 = w;
+                if (c1 > w + d)
+                    c1 = w + d;
+                if (c1 <= c0 || r1 <= r0)
+                    continue;
+
+                slr = CrossTermClipped(ldata, rdata, stride, r0, r1, c0, c1, d);
+                n = (int64_t)(r1 - r0) * (c1 - c0);
+                sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+
+                current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                // Selecting the best disparity
+                if (current_score > best_score)
+                {
+                    best_score = current_score;
+                    best_d = d;
+                }
+            }
+            dmap[i * w + j] = (uint8_t)abs(best_d); // Considering both Left to Right and Right to left disparities
+        }
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
+
+bool CALCZNCC_PYRAMID(const PaddedImage *left, const PaddedImage *right, int32_t levels, ZNCCEngine engine, int32_t bsx, int32_t bsy, int32_t maxd, int32_t radius, uint8_t **dmapLR, uint8_t **dmapRL)
+{
+    /*
+     * Coarse-to-fine LR and RL maps at the size of left and right. The images are
+     * halved levels - 1 times; the coarsest level gets the exhaustive search over
+     * [0, maxd] with engine (CALCZNCC_FUSED when engine is NULL), then every finer
+     * level only searches +/- radius around the doubled estimate. The range doubles
+     * with every level, up to the 255 an 8-bit map can hold.
+     */
+    PaddedImage pyrL[PYRAMID_MAX_LEVELS], pyrR[PYRAMID_MAX_LEVELS];
+    int32_t l, top = levels - 1;
+    int32_t maxd_l;
+    bool ok = true;
+
+    if (levels < 1 || levels > PYRAMID_MAX_LEVELS || (left->w >> top) < 2 || (left->h >> top) < 2)
+    {
+        printf("Invalid number of pyramid levels: %d\n", levels);
+        return false;
+    }
+
+    // Level 0 is the input, level l is halved l times
+    pyrL[0] = *left;
+    pyrR[0] = *right;
+    for (l = 1; l <= top; l++)
+    {
+        pyrL[l].buf = NULL;
+        pyrR[l].buf = NULL;
+    }
+    for (l = 1; l <= top; l++)
+    {
+        uint32_t halo = ZNCCKernelHalo(bsx, maxd << (top - l) < UCHAR_MAX ? maxd << (top - l) : UCHAR_MAX);
+        if (!AllocPaddedImage(&pyrL[l], pyrL[l - 1].w / 2, pyrL[l - 1].h / 2, halo) || !AllocPaddedImage(&pyrR[l], pyrR[l - 1].w / 2, pyrR[l - 1].h / 2, halo))
+        {
+            printf("Out of memory\n");
+            ok = false;
+            break;
+        }
+        DownsampleImage(&pyrL[l - 1], &pyrL[l]);
+        DownsampleImage(&pyrR[l - 1], &pyrR[l]);
+    }
+
+    if (ok)
+    {
+        maxd_l = maxd;
+        if (engine)
+        {
+            *dmapLR = engine(&pyrL[top], &pyrR[top], bsx, bsy, 0, maxd_l);
+            *dmapRL = engine(&pyrR[top], &pyrL[top], bsx, bsy, -maxd_l, 0);
+        }
+        else
+        {
+            CALCZNCC_FUSED(&pyrL[top], &pyrR[top], bsx, bsy, 0, maxd_l, dmapLR, dmapRL);
+        }
+
+        for (l = top - 1; l >= 0; l--)
+        {
+            uint8_t *lr, *rl;
+
+            maxd_l = maxd << (top - l) < UCHAR_MAX ? maxd << (top - l) : UCHAR_MAX;
+            lr = CALCZNCC_REFINE(&pyrL[l], &pyrR[l], bsx, bsy, *dmapLR, pyrL[l + 1].w, pyrL[l + 1].h, 1, radius, maxd_l);
+            rl = CALCZNCC_REFINE(&pyrR[l], &pyrL[l], bsx, bsy, *dmapRL, pyrR[l + 1].w, pyrR[l + 1].h, -1, radius, maxd_l);
+            free(*dmapLR);
+            free(*dmapRL);
+            *dmapLR = lr;
+            *dmapRL = rl;
+        }
+    }
+
+    for (l = 1; l <= top; l++)
+    {
+        FreePaddedImage(&pyrL[l]);
+        FreePaddedImage(&pyrR[l]);
+    }
+    return ok;
+}
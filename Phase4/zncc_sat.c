@@ -0,0 +1,176 @@
+#include "zncc.h"
+
+void IntegralRows(IntegralImage *ii, const PaddedImage *image, int32_t i0, int32_t i1)
+{
+    /* Prefix sums along rows [i0, i1) of the image, into rows i0 + 1 to i1 of the tables */
+    uint32_t w = ii->w, stride = ii->stride;
+    int32_t i, j;
+
+    for (i = i0; i < i1; i++)
+    {
+        int64_t s = 0, sq = 0;
+        int64_t *sum_row = ii->sum + (i + 1) * stride;
+        int64_t *sqsum_row = ii->sqsum + (i + 1) * stride;
+        const uint8_t *row = image->data + (size_t)i * image->stride;
+
+        sum_row[0] = 0;
+        sqsum_row[0] = 0;
+        for (j = 0; j < w; j++)
+        {
+            s += row[j];
+            sq += row[j] * row[j];
+            sum_row[j + 1] = s;
+            sqsum_row[j + 1] = sq;
+        }
+    }
+}
+
+void IntegralColumns(IntegralImage *ii, int32_t c0, int32_t c1)
+{
+    /* Accumulates table columns [c0, c1) downwards, once every row holds its prefix sums */
+    uint32_t h = ii->h, stride = ii->stride;
+    int32_t i, c;
+
+    for (i = 1; i < h; i++)
+    {
+        int64_t *sum_row = ii->sum + (i + 1) * stride;
+        int64_t *sqsum_row = ii->sqsum + (i + 1) * stride;
+        const int64_t *sum_prev = sum_row - stride;
+        const int64_t *sqsum_prev = sqsum_row - stride;
+        for (c = c0; c < c1; c++)
+        {
+            sum_row[c] += sum_prev[c];
+            sqsum_row[c] += sqsum_prev[c];
+        }
+    }
+}
+
+void BuildIntegralImage(IntegralImage *ii, const PaddedImage *image)
+{
+    /* Summed-area tables of the pixel values and of their squares */
+    uint32_t w = image->w, h = image->h;
+    uint32_t stride = w + 1;
+    int32_t i, j;
+
+    ii->w = w;
+    ii->h = h;
+    ii->stride = stride;
+    ii->sum = (int64_t *)malloc((size_t)stride * (h + 1) * sizeof(int64_t));
+    ii->sqsum = (int64_t *)malloc((size_t)stride * (h + 1) * sizeof(int64_t));
+
+    // The first row and column stay zero so that RectSum needs no border cases
+    for (j = 0; j < stride; j++)
+    {
+        ii->sum[j] = 0;
+        ii->sqsum[j] = 0;
+    }
+
+    // Prefix sums along every row
+    #pragma omp parallel for
+    for (i = 0; i < h; i++)
+        IntegralRows(ii, image, i, i + 1);
+
+    // Accumulating the rows downwards, every thread walking down its own strip of columns
+    #pragma omp parallel for
+    for (j = 1; j < stride; j += 64)
+        IntegralColumns(ii, j, j + 64 < stride ? j + 64 : stride);
+}
+
+void FreeIntegralImage(IntegralImage *ii)
+{
+    free(ii->sum);
+    free(ii->sqsum);
+    ii->sum = NULL;
+    ii->sqsum = NULL;
+}
+
+uint8_t *CALCZNCC_SAT(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /* Disparity map computation with window means and variances read from integral images */
+    int32_t w = left->w, h = left->h; // Size of the image, signed so that w + d is negative for d < -w
+    uint32_t stride = left->stride;    // Row pitch of both images
+    const uint8_t *ldata = left->data, *rdata = right->data;
+    int32_t imsize = w * h;
+    int32_t bsize = bsx * bsy; // Block size
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+    int32_t i, j;     // Indices for rows and colums respectively
+    int32_t r0, r1;   // Rows of the window clipped to the image, [r0, r1)
+    int32_t c0, c1;   // Columns of the left window clipped to both images, [c0, c1)
+    int32_t r, c;
+    int32_t d;        // Disparity value
+    int64_t n;        // Number of valid taps in the window
+    int64_t sl, sr, sll, srr, slr;
+    double current_score;
+
+    int32_t best_d;
+    double best_score;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    #pragma omp parallel for private(i, j, r0, r1, c0, c1, r, c, d, n, sl, sr, sll, srr, slr, current_score, best_d, best_score) shared(ldata, rdata, dmap, iil, iir)
+    for (i = 0; i < h; i++)
+    {
+        // The vertical extent of the window does not depend on j or d
+        r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+        r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+
+        for (j = 0; j < w; j++)
+        {
+            best_d = maxd;
+            best_score = -1;
+            for (d = mind; d <= maxd; d++)
+            {
+                // Same taps as the border checks of CALCZNCC: both j + j_b and j + j_b - d inside the image
+                c0 = j - bsx / 2;
+                if (c0 < 0)
+                    c0 = 0;
+                if (c0 < d)
+                    c0 = d;
+                c1 = j + bsx / 2;
+                if (c1 > w)
+                    c1 = w;
+                if (c1 > w + d)
+                    c1 = w + d;
+                if (c1 <= c0 || r1 <= r0)
+                    continue;
+
+                n = (int64_t)(r1 - r0) * (c1 - c0);
+                sl = RectSum(iil.sum, iil.stride, r0, r1, c0, c1);
+                sll = RectSum(iil.sqsum, iil.stride, r0, r1, c0, c1);
+                sr = RectSum(iir.sum, iir.stride, r0, r1, c0 - d, c1 - d);
+                srr = RectSum(iir.sqsum, iir.stride, r0, r1, c0 - d, c1 - d);
+
+                // Only the cross term still needs the window itself
+                slr = 0;
+                for (r = r0; r < r1; r++)
+                {
+                    const uint8_t *lrow = ldata + r * stride;
+                    const uint8_t *rrow = rdata + r * stride - d;
+                    int32_t acc = 0;
+                    for (c = c0; c < c1; c++)
+                    {
+                        acc += lrow[c] * rrow[c];
+                    }
+                    slr += acc;
+                }
+
+                current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                // Selecting the best disparity
+                if (current_score > best_score)
+                {
+                    best_score = current_score;
+                    best_d = d;
+                }
+            }
+            dmap[i * w + j] = (uint8_t)abs(best_d); // Considering both Left to Right and Right to left disparities
+        }
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
@@ -0,0 +1,286 @@
+#include <omp.h>
+#include <sched.h>
+#include <string.h>
+#include "zncc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZNCC_X86
+#endif
+
+/*
+ * Tile scheduler. SCHED_STEAL cuts the image into square tiles dealt out in
+ * contiguous runs to per-worker deques. A worker pops from the tail of its own
+ * deque and, when it runs dry, steals from the head of the others, so the large
+ * tiles queued first are the ones that migrate. The workers share a running cost
+ * per pixel; a tile expected to take longer than SCHED_TARGET is split in two and
+ * the half it does not run is pushed back, where a thief can pick it up. Until the
+ * first measurement, tiles are split down to probes of SCHED_MIN_TILE pixels.
+ * A worker that finds every deque empty while tiles are still running backs off
+ * exponentially before sweeping the deques again, then yields its core.
+ * SCHED_STATIC is the original `omp parallel for` over rows, for comparison.
+ */
+
+#define SCHED_TARGET 0.002 // Seconds of work per tile aimed for by the splitting
+#define SCHED_MIN_TILE 8   // Tiles are not split below this size
+#define SCHED_MAX_SPIN 1024 // Pause instructions of the longest back-off before yielding
+
+SchedConfig Sched = {SCHED_STEAL, 64};
+
+typedef struct
+{
+    int32_t r0, r1, c0, c1;
+} Tile;
+
+typedef struct
+{
+    Tile *items;
+    int32_t head, tail, cap; // Tiles [head, tail) are queued
+    omp_lock_t lock;
+} TileDeque;
+
+static WorkerStats *Stats = NULL;
+static int32_t StatsThreads = 0;
+static double StatsWall = 0;
+
+static void PushTile(TileDeque *q, Tile t)
+{
+    omp_set_lock(&q->lock);
+    if (q->tail == q->cap)
+    {
+        // Compacting first, growing if the deque is really full
+        if (q->head > 0)
+        {
+            memmove(q->items, q->items + q->head, (q->tail - q->head) * sizeof(Tile));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if (q->tail == q->cap)
+        {
+            q->cap = 2 * q->cap + 16;
+            q->items = (Tile *)realloc(q->items, q->cap * sizeof(Tile));
+        }
+    }
+    q->items[q->tail++] = t;
+    omp_unset_lock(&q->lock);
+}
+
+static bool PopTile(TileDeque *q, Tile *t, bool own)
+{
+    /* The owner takes the newest tile (tail), thieves the oldest (head) */
+    bool found = false;
+
+    omp_set_lock(&q->lock);
+    if (q->head < q->tail)
+    {
+        *t = own ? q->items[--q->tail] : q->items[q->head++];
+        found = true;
+    }
+    omp_unset_lock(&q->lock);
+    return found;
+}
+
+static void EnsureStats(int32_t nthreads)
+{
+    if (StatsThreads < nthreads)
+    {
+        Stats = (WorkerStats *)realloc(Stats, nthreads * sizeof(WorkerStats));
+        memset(Stats + StatsThreads, 0, (nthreads - StatsThreads) * sizeof(WorkerStats));
+        StatsThreads = nthreads;
+    }
+}
+
+static void RunTilesStatic(uint32_t w, uint32_t h, TileFn fn, void *arg)
+{
+    double start = omp_get_wtime();
+
+    #pragma omp parallel
+    {
+        WorkerStats *ws = &Stats[omp_get_thread_num()];
+        int32_t i;
+
+        #pragma omp for
+        for (i = 0; i < h; i++)
+        {
+            double t0 = omp_get_wtime();
+            fn(arg, i, i + 1, 0, w);
+            ws->busy += omp_get_wtime() - t0;
+            ws->tiles++;
+        }
+    }
+    StatsWall += omp_get_wtime() - start;
+}
+
+static void Backoff(int32_t *spins)
+{
+    /* Waits twice as long as the previous time, up to SCHED_MAX_SPIN pauses, then yields */
+    int32_t k;
+
+    if (*spins >= SCHED_MAX_SPIN)
+    {
+        sched_yield();
+        return;
+    }
+    for (k = 0; k < *spins; k++)
+    {
+#ifdef ZNCC_X86
+        _mm_pause();
+#endif
+    }
+    *spins *= 2;
+}
+
+static void RunTilesSteal(uint32_t w, uint32_t h, TileFn fn, void *arg)
+{
+    int32_t nthreads = omp_get_max_threads();
+    int32_t tile = Sched.tile > 0 ? Sched.tile : 64;
+    int32_t tx, ty;
+    int64_t remaining = (int64_t)w * h; // Pixels not computed yet
+    double cost = -1;                   // Running estimate of the seconds per pixel, shared by the workers
+    TileDeque *queues = (TileDeque *)malloc(nthreads * sizeof(TileDeque));
+    double start = omp_get_wtime();
+    int32_t k;
+
+    // At least 4 tiles per worker, so that small images still spread
+    while (tile > SCHED_MIN_TILE && (int64_t)tile * tile * 4 * nthreads > (int64_t)w * h)
+        tile /= 2;
+    tx = (w + tile - 1) / tile;
+    ty = (h + tile - 1) / tile;
+
+    for (k = 0; k < nthreads; k++)
+    {
+        queues[k].cap = tx * ty / nthreads + 16;
+        queues[k].items = (Tile *)malloc(queues[k].cap * sizeof(Tile));
+        queues[k].head = 0;
+        queues[k].tail = 0;
+        omp_init_lock(&queues[k].lock);
+    }
+    // Contiguous runs of tiles per worker, in row-major order
+    for (k = 0; k < tx * ty; k++)
+    {
+        Tile t;
+        t.r0 = k / tx * tile;
+        t.r1 = t.r0 + tile < h ? t.r0 + tile : h;
+        t.c0 = k % tx * tile;
+        t.c1 = t.c0 + tile < w ? t.c0 + tile : w;
+        PushTile(&queues[(int64_t)k * nthreads / (tx * ty)], t);
+    }
+    // The owner pops from the tail: reversing each run makes it start with its first tile
+    for (k = 0; k < nthreads; k++)
+    {
+        int32_t a, b;
+        for (a = queues[k].head, b = queues[k].tail - 1; a < b; a++, b--)
+        {
+            Tile t = queues[k].items[a];
+            queues[k].items[a] = queues[k].items[b];
+            queues[k].items[b] = t;
+        }
+    }
+
+    #pragma omp parallel num_threads(nthreads)
+    {
+        int32_t me = omp_get_thread_num();
+        WorkerStats *ws = &Stats[me];
+        double estimate; // Copy of cost
+        int64_t left;
+        int32_t spins = 1; // Length of the next back-off while idle
+        Tile t;
+
+        for (;;)
+        {
+            bool found = PopTile(&queues[me], &t, true);
+            int32_t v;
+
+            for (v = 1; !found && v < nthreads; v++)
+            {
+                found = PopTile(&queues[(me + v) % nthreads], &t, false);
+                if (found)
+                    ws->stolen++;
+            }
+            if (!found)
+            {
+                // Nothing queued: done once every pixel is computed, otherwise a split may still come
+                #pragma omp atomic read
+                left = remaining;
+                if (left == 0)
+                    break;
+                Backoff(&spins);
+                continue;
+            }
+            spins = 1;
+
+            // Splitting along the longer side while the tile is expected to run too long
+            #pragma omp atomic read
+            estimate = cost;
+            while ((estimate < 0 || estimate * (t.r1 - t.r0) * (t.c1 - t.c0) > SCHED_TARGET) &&
+                   (t.r1 - t.r0 >= 2 * SCHED_MIN_TILE || t.c1 - t.c0 >= 2 * SCHED_MIN_TILE))
+            {
+                Tile half = t;
+                if (t.r1 - t.r0 >= t.c1 - t.c0)
+                {
+                    t.r1 = (t.r0 + t.r1) / 2;
+                    half.r0 = t.r1;
+                }
+                else
+                {
+                    t.c1 = (t.c0 + t.c1) / 2;
+                    half.c0 = t.c1;
+                }
+                PushTile(&queues[me], half);
+                ws->splits++;
+            }
+
+            {
+                double t0 = omp_get_wtime(), elapsed;
+                int64_t area = (int64_t)(t.r1 - t.r0) * (t.c1 - t.c0);
+
+                fn(arg, t.r0, t.r1, t.c0, t.c1);
+                elapsed = omp_get_wtime() - t0;
+                ws->busy += elapsed;
+                ws->tiles++;
+                estimate = estimate < 0 ? elapsed / area : 0.75 * estimate + 0.25 * elapsed / area;
+                #pragma omp atomic write
+                cost = estimate;
+
+                #pragma omp atomic
+                remaining -= area;
+            }
+        }
+    }
+
+    StatsWall += omp_get_wtime() - start;
+    for (k = 0; k < nthreads; k++)
+    {
+        omp_destroy_lock(&queues[k].lock);
+        free(queues[k].items);
+    }
+    free(queues);
+}
+
+void RunTiles(uint32_t w, uint32_t h, TileFn fn, void *arg)
+{
+    EnsureStats(omp_get_max_threads());
+    if (Sched.kind == SCHED_STATIC)
+        RunTilesStatic(w, h, fn, arg);
+    else
+        RunTilesSteal(w, h, fn, arg);
+}
+
+void SchedResetStats(void)
+{
+    if (StatsThreads > 0)
+        memset(Stats, 0, StatsThreads * sizeof(WorkerStats));
+    StatsWall = 0;
+}
+
+void SchedReport(void)
+{
+    /* Busy time per worker over all RunTiles calls so far; idle is the rest of the wall time */
+    int32_t k;
+
+    for (k = 0; k < StatsThreads; k++)
+    {
+        printf("Thread %2d: busy %.3f s, idle %.3f s, %d tiles (%d stolen, %d splits)\n", k, Stats[k].busy,
+               StatsWall - Stats[k].busy, Stats[k].tiles, Stats[k].stolen, Stats[k].splits);
+    }
+}
@@ -0,0 +1,217 @@
+#include <omp.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "zncc.h"
+
+/*
+ * Multi-process mode. The coordinator copies the padded grayscale pair into a POSIX
+ * shared-memory segment and starts worker processes of the same program (-W), each
+ * with its own OpenMP team. Worker k computes the LR and RL rows of band k with the
+ * CALCZNCC_SIMD kernels: it reads its rows plus bsy / 2 rows of halo on each side
+ * straight from the segment, builds the integral images of that range only and
+ * writes its rows of both maps back into the segment. The coordinator then copies
+ * the maps out; cross-check and fill run on them as usual.
+ */
+
+#define SHARD_MAGIC 0x5A4E4343 // "ZNCC"
+
+extern char **environ;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t w, h, stride, halo; // Interior size and layout of both images
+    int32_t bsx, bsy, maxd;
+    size_t left, right, lr, rl;  // Offsets of the image interiors and of the maps from the start of the segment
+    double seconds[SHARD_MAX_WORKERS]; // Map time of every worker
+} ShardHeader;
+
+static void BandRows(uint32_t h, int32_t workers, int32_t k, int32_t *i0, int32_t *i1)
+{
+    /* Rows of worker k, contiguous bands as even as possible */
+    *i0 = (int64_t)h * k / workers;
+    *i1 = (int64_t)h * (k + 1) / workers;
+}
+
+static size_t Align(size_t offset)
+{
+    return (offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+}
+
+bool ShardMaps(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t maxd, int32_t workers, const char *prog,
+               uint8_t **dmapLR, uint8_t **dmapRL)
+{
+    uint32_t w = left->w, h = left->h;
+    size_t image = (size_t)left->stride * (left->h + 2 * left->halo); // Bytes of each padded image, halo included
+    size_t at_left = Align(sizeof(ShardHeader)), at_right = Align(at_left + image);
+    size_t at_lr = Align(at_right + image), at_rl = Align(at_lr + (size_t)w * h), size = at_rl + (size_t)w * h;
+    int32_t threads = omp_get_max_threads() / workers > 0 ? omp_get_max_threads() / workers : 1;
+    pid_t *pids;
+    char name[64], spec[96];
+    ShardHeader *hdr;
+    uint8_t *seg;
+    bool ok = true;
+    int32_t fd, k, status;
+
+    if (workers < 1 || workers > SHARD_MAX_WORKERS || left->stride != right->stride || left->halo != right->halo)
+        return false;
+
+    snprintf(name, sizeof(name), "/zncc-%d", (int)getpid());
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+        printf("shm_open %s: %s\n", name, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, size) != 0 || (seg = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        printf("Could not map %zu bytes of shared memory: %s\n", size, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    close(fd);
+
+    hdr = (ShardHeader *)seg;
+    memset(hdr, 0, sizeof(ShardHeader));
+    hdr->magic = SHARD_MAGIC;
+    hdr->w = w;
+    hdr->h = h;
+    hdr->stride = left->stride;
+    hdr->halo = left->halo;
+    hdr->bsx = bsx;
+    hdr->bsy = bsy;
+    hdr->maxd = maxd;
+    hdr->left = at_left + (left->data - left->buf);
+    hdr->right = at_right + (right->data - right->buf);
+    hdr->lr = at_lr;
+    hdr->rl = at_rl;
+    memcpy(seg + at_left, left->buf, image);
+    memcpy(seg + at_right, right->buf, image);
+
+    // Workers split the threads of this process between them
+    pids = (pid_t *)malloc(workers * sizeof(pid_t));
+    for (k = 0; k < workers; k++)
+    {
+        char *args[] = {(char *)prog, (char *)"-W", spec, NULL};
+
+        snprintf(spec, sizeof(spec), "%s:%d:%d:%d", name, k, workers, threads);
+        if (posix_spawnp(&pids[k], prog, NULL, NULL, args, environ) != 0)
+        {
+            printf("Could not start worker %d\n", k);
+            pids[k] = -1;
+            ok = false;
+        }
+    }
+    for (k = 0; k < workers; k++)
+    {
+        if (pids[k] > 0 && (waitpid(pids[k], &status, 0) != pids[k] || !WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        {
+            printf("Worker %d failed\n", k);
+            ok = false;
+        }
+    }
+
+    if (ok)
+    {
+        for (k = 0; k < workers; k++)
+        {
+            int32_t i0, i1;
+            BandRows(h, workers, k, &i0, &i1);
+            printf("Worker %d: rows %d-%d, %d threads, %.6f seconds\n", k, i0, i1 - 1, threads, hdr->seconds[k]);
+        }
+        *dmapLR = (uint8_t *)malloc(w * h);
+        *dmapRL = (uint8_t *)malloc(w * h);
+        memcpy(*dmapLR, seg + at_lr, (size_t)w * h);
+        memcpy(*dmapRL, seg + at_rl, (size_t)w * h);
+    }
+
+    free(pids);
+    munmap(seg, size);
+    shm_unlink(name);
+    return ok;
+}
+
+int32_t ShardWorker(const char *spec)
+{
+    /* spec is "name:k:workers:threads"; the band of worker k goes into the maps of the segment */
+    char name[64];
+    int32_t k, workers, threads, fd, i0, i1, r0, r1;
+    struct stat st;
+    uint8_t *seg;
+    ShardHeader *hdr;
+    PaddedImage viewL, viewR;
+    IntegralImage iil, iir;
+    double t0;
+
+    if (sscanf(spec, "%63[^:]:%d:%d:%d", name, &k, &workers, &threads) != 4 || k < 0 || k >= workers || workers > SHARD_MAX_WORKERS || threads < 1)
+    {
+        printf("Invalid worker spec: %s\n", spec);
+        return 1;
+    }
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0 || fstat(fd, &st) != 0 || (seg = (uint8_t *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        printf("Worker %d: could not map %s\n", k, name);
+        return 1;
+    }
+    close(fd);
+    hdr = (ShardHeader *)seg;
+    if (hdr->magic != SHARD_MAGIC)
+    {
+        printf("Worker %d: %s is not a zncc segment\n", k, name);
+        return 1;
+    }
+    omp_set_num_threads(threads);
+
+    // Rows of the band and of its windows: the views start at image row r0
+    t0 = omp_get_wtime();
+    BandRows(hdr->h, workers, k, &i0, &i1);
+    r0 = i0 - hdr->bsy / 2 > 0 ? i0 - hdr->bsy / 2 : 0;
+    r1 = i1 + hdr->bsy / 2 < (int32_t)hdr->h ? i1 + hdr->bsy / 2 : (int32_t)hdr->h;
+    viewL.w = viewR.w = hdr->w;
+    viewL.h = viewR.h = r1 - r0;
+    viewL.stride = viewR.stride = hdr->stride;
+    viewL.halo = viewR.halo = hdr->halo;
+    viewL.mode = viewR.mode = HALO_ZERO;
+    viewL.data = seg + hdr->left + (size_t)r0 * hdr->stride;
+    viewR.data = seg + hdr->right + (size_t)r0 * hdr->stride;
+    viewL.buf = viewL.data;
+    viewR.buf = viewR.data;
+
+    if (i1 > i0)
+    {
+        BuildIntegralImage(&iil, &viewL);
+        BuildIntegralImage(&iir, &viewR);
+
+        #pragma omp parallel
+        {
+            double *best_score = (double *)malloc(hdr->w * sizeof(double));
+            int32_t *best_d = (int32_t *)malloc(hdr->w * sizeof(int32_t));
+            int32_t i;
+
+            #pragma omp for schedule(dynamic, 4)
+            for (i = i0; i < i1; i++)
+            {
+                ZNCCSimdRows(&viewL, &viewR, &iil, &iir, r0, hdr->h, i, i + 1, hdr->bsx, hdr->bsy, 0, hdr->maxd, best_score, best_d, seg + hdr->lr, NULL, NULL);
+                ZNCCSimdRows(&viewR, &viewL, &iir, &iil, r0, hdr->h, i, i + 1, hdr->bsx, hdr->bsy, -hdr->maxd, 0, best_score, best_d, seg + hdr->rl, NULL, NULL);
+            }
+
+            free(best_score);
+            free(best_d);
+        }
+
+        FreeIntegralImage(&iil);
+        FreeIntegralImage(&iir);
+    }
+    hdr->seconds[k] = omp_get_wtime() - t0;
+
+    munmap(seg, st.st_size);
+    return 0;
+}
@@ -0,0 +1,524 @@
+#include <string.h>
+#include "zncc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ZNCC_X86
+#endif
+
+static void CrossTermGeneric(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t x0, int32_t taps, int32_t d, int32_t *slr)
+{
+    int32_t r, t, k;
+
+    for (k = 0; k < 8; k++)
+        slr[k] = 0;
+    for (r = r0; r < r1; r++)
+    {
+        const uint8_t *lp = left + r * stride + x0;
+        const uint8_t *rp = right + r * stride + x0 - d;
+        for (t = 0; t < taps; t++)
+        {
+            for (k = 0; k < 8; k++)
+                slr[k] += lp[k + t] * rp[k + t];
+        }
+    }
+}
+
+#ifdef ZNCC_X86
+__attribute__((target("sse4.1")))
+static void CrossTermSSE41(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t x0, int32_t taps, int32_t d, int32_t *slr)
+{
+    __m128i acc = _mm_setzero_si128();
+    int32_t r, t;
+    uint32_t a, b;
+
+    for (r = r0; r < r1; r++)
+    {
+        const uint8_t *lp = left + r * stride + x0;
+        const uint8_t *rp = right + r * stride + x0 - d;
+        for (t = 0; t < taps; t += 2)
+        {
+            __m128i l, rr;
+            // Interleaving p[t..t+3] with p[t+1..t+4] gives the tap pairs of 4 pixels
+            memcpy(&a, lp + t, 4);
+            memcpy(&b, lp + t + 1, 4);
+            l = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b));
+            memcpy(&a, rp + t, 4);
+            memcpy(&b, rp + t + 1, 4);
+            rr = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_cvtepu8_epi16(l), _mm_cvtepu8_epi16(rr)));
+        }
+    }
+    _mm_storeu_si128((__m128i *)slr, acc);
+}
+
+__attribute__((target("avx2")))
+static void CrossTermAVX2(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t x0, int32_t taps, int32_t d, int32_t *slr)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int32_t r, t;
+
+    for (r = r0; r < r1; r++)
+    {
+        const uint8_t *lp = left + r * stride + x0;
+        const uint8_t *rp = right + r * stride + x0 - d;
+        for (t = 0; t < taps; t += 2)
+        {
+            // Interleaving p[t..t+7] with p[t+1..t+8] gives the tap pairs of 8 pixels
+            __m128i l = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(lp + t)), _mm_loadl_epi64((const __m128i *)(lp + t + 1)));
+            __m128i rr = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rp + t)), _mm_loadl_epi64((const __m128i *)(rp + t + 1)));
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepu8_epi16(l), _mm256_cvtepu8_epi16(rr)));
+        }
+    }
+    _mm256_storeu_si256((__m256i *)slr, acc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void CrossTermAVX512(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t x0, int32_t taps, int32_t d, int32_t *slr)
+{
+    __m512i acc = _mm512_setzero_si512();
+    int32_t r, t;
+
+    for (r = r0; r < r1; r++)
+    {
+        const uint8_t *lp = left + r * stride + x0;
+        const uint8_t *rp = right + r * stride + x0 - d;
+        for (t = 0; t < taps; t += 2)
+        {
+            // Interleaving p[t..t+15] with p[t+1..t+16] gives the tap pairs of 16 pixels
+            __m128i a = _mm_loadu_si128((const __m128i *)(lp + t));
+            __m128i b = _mm_loadu_si128((const __m128i *)(lp + t + 1));
+            __m256i l = _mm256_set_m128i(_mm_unpackhi_epi8(a, b), _mm_unpacklo_epi8(a, b));
+            __m256i rr;
+            a = _mm_loadu_si128((const __m128i *)(rp + t));
+            b = _mm_loadu_si128((const __m128i *)(rp + t + 1));
+            rr = _mm256_set_m128i(_mm_unpackhi_epi8(a, b), _mm_unpacklo_epi8(a, b));
+            acc = _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_cvtepu8_epi16(l), _mm512_cvtepu8_epi16(rr)));
+        }
+    }
+    _mm512_storeu_si512((void *)slr, acc);
+}
+#endif
+
+static const struct
+{
+    const char *name;
+    int32_t lanes; // Pixels scored per call
+    CrossTermKernel fn;
+} CrossTermKernels[] = {
+#ifdef ZNCC_X86
+    {"avx512", 16, CrossTermAVX512},
+    {"avx2", 8, CrossTermAVX2},
+    {"sse4.1", 4, CrossTermSSE41},
+#endif
+    {"generic", 8, CrossTermGeneric},
+};
+
+static int32_t SelectedKernel = -1; // Index in CrossTermKernels, -1 until resolved
+
+static bool KernelSupported(const char *name)
+{
+#ifdef ZNCC_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "avx512") == 0)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (strcmp(name, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse4.1") == 0)
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    return true;
+}
+
+static int32_t ResolveKernel(void)
+{
+    /*
+     * Widest kernel the CPU supports; ZNCC_SIMD=<name> caps it for comparisons.
+     * Resolved once, by the first caller, even when the first calls come from
+     * inside a parallel region.
+     */
+    int32_t selected;
+
+    #pragma omp atomic read
+    selected = SelectedKernel;
+    if (selected >= 0)
+        return selected;
+
+    #pragma omp critical(ZNCCSimdSelect)
+    {
+        if (SelectedKernel < 0)
+        {
+            const char *cap = getenv("ZNCC_SIMD");
+            int32_t k, first = 0;
+            int32_t nkernels = sizeof(CrossTermKernels) / sizeof(CrossTermKernels[0]);
+
+            if (cap && *cap)
+            {
+                for (first = 0; first < nkernels && strcmp(cap, CrossTermKernels[first].name) != 0; first++)
+                    ;
+                if (first == nkernels)
+                {
+                    printf("Unknown ZNCC_SIMD kernel %s, using the widest supported one\n", cap);
+                    first = 0;
+                }
+            }
+            for (k = first; k < nkernels; k++)
+            {
+                if (KernelSupported(CrossTermKernels[k].name))
+                    break;
+            }
+            #pragma omp atomic write
+            SelectedKernel = k;
+        }
+        selected = SelectedKernel;
+    }
+    return selected;
+}
+
+const char *ZNCCSimdVariant(void)
+{
+    return CrossTermKernels[ResolveKernel()].name;
+}
+
+CrossTermKernel SelectCrossTermKernel(int32_t *lanes)
+{
+    int32_t k = ResolveKernel();
+
+    *lanes = CrossTermKernels[k].lanes;
+    return CrossTermKernels[k].fn;
+}
+
+#define REMAP_BLOCK 4096 // Bytes per work item of RemapBytes
+
+static void RemapGeneric(const uint8_t *lut, uint8_t *data, size_t n)
+{
+    size_t k;
+
+    for (k = 0; k < n; k++)
+        data[k] = lut[data[k]];
+}
+
+#ifdef ZNCC_X86
+__attribute__((target("sse4.1")))
+static void RemapSSE41(const uint8_t *lut, uint8_t *data, size_t n)
+{
+    /* The table as 16 shuffles of 16 entries, each kept where the high nibble selects it */
+    const __m128i low = _mm_set1_epi8(0x0F);
+    __m128i tables[16];
+    size_t k;
+    int32_t t;
+
+    for (t = 0; t < 16; t++)
+        tables[t] = _mm_loadu_si128((const __m128i *)(lut + 16 * t));
+    for (k = 0; k + 16 <= n; k += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + k));
+        __m128i lo = _mm_and_si128(v, low);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low);
+        __m128i r = _mm_setzero_si128();
+        for (t = 0; t < 16; t++)
+            r = _mm_or_si128(r, _mm_and_si128(_mm_cmpeq_epi8(hi, _mm_set1_epi8(t)), _mm_shuffle_epi8(tables[t], lo)));
+        _mm_storeu_si128((__m128i *)(data + k), r);
+    }
+    RemapGeneric(lut, data + k, n - k);
+}
+
+__attribute__((target("avx2")))
+static void RemapAVX2(const uint8_t *lut, uint8_t *data, size_t n)
+{
+    /* As RemapSSE41 on 32 bytes, the 16-entry tables repeated in both lanes */
+    const __m256i low = _mm256_set1_epi8(0x0F);
+    __m256i tables[16];
+    size_t k;
+    int32_t t;
+
+    for (t = 0; t < 16; t++)
+        tables[t] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + 16 * t)));
+    for (k = 0; k + 32 <= n; k += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + k));
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i r = _mm256_setzero_si256();
+        for (t = 0; t < 16; t++)
+            r = _mm256_or_si256(r, _mm256_and_si256(_mm256_cmpeq_epi8(hi, _mm256_set1_epi8(t)), _mm256_shuffle_epi8(tables[t], lo)));
+        _mm256_storeu_si256((__m256i *)(data + k), r);
+    }
+    RemapGeneric(lut, data + k, n - k);
+}
+#endif
+
+void RemapBytes(const uint8_t *lut, uint8_t *data, size_t n)
+{
+    /* data[k] = lut[data[k]] with the widest shuffle of the selected kernel family, blocks in parallel */
+    void (*remap)(const uint8_t *, uint8_t *, size_t) = RemapGeneric;
+    const char *variant = ZNCCSimdVariant();
+    int64_t b;
+
+#ifdef ZNCC_X86
+    if (strcmp(variant, "avx512") == 0 || strcmp(variant, "avx2") == 0)
+        remap = RemapAVX2;
+    else if (strcmp(variant, "sse4.1") == 0)
+        remap = RemapSSE41;
+#endif
+
+    #pragma omp parallel for schedule(static)
+    for (b = 0; b < (int64_t)((n + REMAP_BLOCK - 1) / REMAP_BLOCK); b++)
+    {
+        size_t k = (size_t)b * REMAP_BLOCK;
+        remap(lut, data + k, n - k < REMAP_BLOCK ? n - k : REMAP_BLOCK);
+    }
+}
+
+int64_t CrossTermClipped(const uint8_t *left, const uint8_t *right, uint32_t stride, int32_t r0, int32_t r1, int32_t c0, int32_t c1, int32_t d)
+{
+    int64_t slr = 0;
+    int32_t r, c;
+
+    for (r = r0; r < r1; r++)
+    {
+        const uint8_t *lrow = left + r * stride;
+        const uint8_t *rrow = right + r * stride - d;
+        int32_t acc = 0;
+        for (c = c0; c < c1; c++)
+            acc += lrow[c] * rrow[c];
+        slr += acc;
+    }
+    return slr;
+}
+
+bool ZeroHaloCovers(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t mind, int32_t maxd)
+{
+    uint32_t need = ZNCCKernelHalo(bsx, abs(mind) > abs(maxd) ? mind : maxd);
+
+    return left->mode == HALO_ZERO && right->mode == HALO_ZERO && left->halo >= need && right->halo >= need;
+}
+
+#define NO_SCORE -2.0 // Below every ZNCC score
+
+struct PeakState
+{
+    double prev;   // Score at disparity prevd
+    double lag;    // Best score below prevd
+    double before; // Best score more than one disparity below the winner
+    double after;  // Best score more than one disparity above the winner
+    double minus;  // Scores at the winner - 1 and + 1, for the sub-pixel fit
+    double plus;
+    int32_t prevd;
+};
+
+static inline void TrackPeaks(PeakState *p, double score, int32_t d, double best_score, int32_t best_d)
+{
+    /* Before the winner of d - 1 (best_score, best_d) is updated with score */
+    double below = p->prevd == d - 1 ? p->lag : (p->lag > p->prev ? p->lag : p->prev); // Best score up to d - 2
+
+    if (score > best_score)
+    {
+        p->before = below;
+        p->after = NO_SCORE;
+        p->minus = p->prevd == d - 1 ? p->prev : NO_SCORE;
+        p->plus = NO_SCORE;
+    }
+    else if (d == best_d + 1)
+        p->plus = score;
+    else if (d > best_d + 1 && score > p->after)
+        p->after = score;
+    p->lag = p->lag > p->prev ? p->lag : p->prev;
+    p->prev = score;
+    p->prevd = d;
+}
+
+static inline uint8_t Confidence(const PeakState *p, double best_score)
+{
+    double second = p->before > p->after ? p->before : p->after;
+
+    if (best_score <= -1)
+        return 0;
+    if (second < -1)
+        second = -1;
+    return (uint8_t)(127.5 * (best_score - second) + 0.5);
+}
+
+static inline uint16_t SubPixel(const PeakState *p, double best_score, int32_t best_d)
+{
+    /* Vertex of the parabola through (-1, minus), (0, best), (1, plus) */
+    double curve = p->minus - 2 * best_score + p->plus;
+    double offset = 0;
+
+    if (best_score > -1 && p->minus > NO_SCORE && p->plus > NO_SCORE && curve < 0)
+    {
+        offset = (p->minus - p->plus) / (2 * curve);
+        offset = offset < -0.5 ? -0.5 : (offset > 0.5 ? 0.5 : offset);
+    }
+    return (uint16_t)(fabs(best_d + offset) * SUBPIXEL_SCALE + 0.5);
+}
+
+void ZNCCSimdRows(const PaddedImage *left, const PaddedImage *right, const IntegralImage *iil, const IntegralImage *iir, int32_t row0, int32_t h,
+                  int32_t i0, int32_t i1, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, double *best_score, int32_t *best_d, uint8_t *dmap,
+                  const ZNCCExtra *extra, PeakState *peaks)
+{
+    /*
+     * Rows [i0, i1) of an image of height h. Row 0 of left, right and of their
+     * integral images is image row row0, so the rows may come from a band buffer;
+     * the windows are clipped to the image, not to the band.
+     */
+    int32_t w = left->w;            // Width of the image, signed so that w + d is negative for d < -w
+    uint32_t stride = left->stride; // Row pitch of both images
+    const uint8_t *ldata = NumaLocal(left)->data, *rdata = NumaLocal(right)->data; // Copies on this thread's node with -r
+    int32_t bsize = bsx * bsy; // Block size
+    int32_t taps = 2 * (bsx / 2); // Columns of the window, j_b in [-bsx / 2, bsx / 2)
+    int32_t slr_block[16];
+    CrossTermKernel kernel;
+    int32_t lanes;
+    bool padded; // Zero halos wide enough for the kernel to score the border pixels as well
+    int32_t i;
+
+    if (!extra || (!extra->confidence && !extra->subpixel))
+        peaks = NULL; // Peaks of every pixel of the row are only tracked for the maps of extra
+    kernel = SelectCrossTermKernel(&lanes);
+    padded = ZeroHaloCovers(left, right, bsx, mind, maxd);
+
+    for (i = i0; i < i1; i++)
+    {
+        // Window rows clipped to the image, then made relative to the buffers
+        int32_t r0 = (i - bsy / 2 > 0 ? i - bsy / 2 : 0) - row0;
+        int32_t r1 = (i + bsy / 2 < h ? i + bsy / 2 : h) - row0;
+        int32_t j, d;
+        int32_t c0, c1;
+        int32_t jlo, jhi; // Pixels scored by the kernel, [jlo, jhi)
+        int64_t n, sl, sr, sll, srr, slr;
+        double current_score;
+
+        for (j = 0; j < w; j++)
+        {
+            best_score[j] = -1;
+            best_d[j] = maxd;
+        }
+        if (peaks)
+        {
+            for (j = 0; j < w; j++)
+            {
+                peaks[j].prev = peaks[j].lag = peaks[j].before = peaks[j].after = peaks[j].minus = peaks[j].plus = NO_SCORE;
+                peaks[j].prevd = mind - 2;
+            }
+        }
+
+        for (d = mind; d <= maxd; d++)
+        {
+            if (padded)
+            {
+                // Taps outside either image read halo zeros, so the kernel covers the whole row
+                jlo = 0;
+                jhi = w;
+            }
+            else
+            {
+                // Only the windows lying inside both images
+                jlo = bsx / 2 + (d > 0 ? d : 0);
+                jhi = (d < 0 ? (int32_t)w + d : (int32_t)w) - bsx / 2 + 1;
+                jhi = jhi > jlo ? jlo + (jhi - jlo) / lanes * lanes : jlo;
+            }
+
+            for (j = 0; j < w; j++)
+            {
+                // One kernel call scores the next lanes pixels
+                if (j >= jlo && j < jhi && (j - jlo) % lanes == 0 && r1 > r0)
+                    kernel(ldata, rdata, stride, r0, r1, j - bsx / 2, taps, d, slr_block);
+
+                // Same taps as the border checks of CALCZNCC
+                c0 = j - bsx / 2;
+                if (c0 < 0)
+                    c0 = 0;
+                if (c0 < d)
+                    c0 = d;
+                c1 = j + bsx / 2;
+                if (c1 > w)
+                    c1 = w;
+                if (c1 > w + d)
+                    c1 = w + d;
+                if (c1 <= c0 || r1 <= r0)
+                    continue;
+
+                if (j >= jlo && j < jhi)
+                    slr = slr_block[(j - jlo) % lanes];
+                else
+                    slr = CrossTermClipped(ldata, rdata, stride, r0, r1, c0, c1, d);
+
+                n = (int64_t)(r1 - r0) * (c1 - c0);
+                sl = RectSum(iil->sum, iil->stride, r0, r1, c0, c1);
+                sll = RectSum(iil->sqsum, iil->stride, r0, r1, c0, c1);
+                sr = RectSum(iir->sum, iir->stride, r0, r1, c0 - d, c1 - d);
+                srr = RectSum(iir->sqsum, iir->stride, r0, r1, c0 - d, c1 - d);
+
+                current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                if (peaks)
+                    TrackPeaks(&peaks[j], current_score, d, best_score[j], best_d[j]);
+                // Selecting the best disparity
+                if (current_score > best_score[j])
+                {
+                    best_score[j] = current_score;
+                    best_d[j] = d;
+                }
+            }
+        }
+
+        for (j = 0; j < w; j++)
+            dmap[i * w + j] = (uint8_t)abs(best_d[j]); // Considering both Left to Right and Right to left disparities
+        if (peaks && extra->confidence)
+        {
+            for (j = 0; j < w; j++)
+                extra->confidence[i * w + j] = Confidence(&peaks[j], best_score[j]);
+        }
+        if (peaks && extra->subpixel)
+        {
+            for (j = 0; j < w; j++)
+                extra->subpixel[i * w + j] = SubPixel(&peaks[j], best_score[j], best_d[j]);
+        }
+    }
+}
+
+uint8_t *CALCZNCC_SIMD(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    return CALCZNCC_SIMD_EXTRA(left, right, bsx, bsy, mind, maxd, NULL);
+}
+
+uint8_t *CALCZNCC_SIMD_EXTRA(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd, const ZNCCExtra *extra)
+{
+    /*
+     * Disparity map computation with the cross term of blocks of adjacent pixels
+     * computed by the vector kernel picked at run time. Pixels whose window is clipped
+     * by a border go through the scalar path, unless both images carry zero halos
+     * wide enough for the kernel to read past the edges. Means and variances come
+     * from the integral images.
+     */
+    uint32_t w = left->w, h = left->h; // Size of the image
+    int32_t imsize = w * h;
+
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+
+    SetLoopSchedule(&RowLoop);
+    #pragma omp parallel shared(dmap, iil, iir)
+    {
+        double *best_score = (double *)malloc(w * sizeof(double));
+        int32_t *best_d = (int32_t *)malloc(w * sizeof(int32_t));
+        PeakState *peaks = extra ? (PeakState *)malloc(w * sizeof(PeakState)) : NULL;
+        int32_t i;
+
+        #pragma omp for schedule(runtime)
+        for (i = 0; i < h; i++)
+            ZNCCSimdRows(left, right, &iil, &iir, 0, h, i, i + 1, bsx, bsy, mind, maxd, best_score, best_d, dmap, extra, peaks);
+
+        free(best_score);
+        free(best_d);
+        free(peaks);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
@@ -0,0 +1,235 @@
+#include "zncc.h"
+
+/*
+ * Disparity map computation specialized at compile time. Every wrapper below opens
+ * its own parallel loop over the rows and calls ZNCCSpecRow, which is always
+ * inlined, with literal window sizes and disparity counts: each instantiation gets
+ * its own outlined loop body with constant loop bounds, which the compiler fully
+ * unrolls. Window statistics come from the integral images. Pixels whose window
+ * is never clipped keep their left window in a fixed-size local array and run the
+ * disparity loop over it; border pixels use the clipped loop.
+ */
+typedef struct
+{
+    const uint8_t *ldata, *rdata; // Pixels of both images
+    uint32_t stride;              // Row pitch of both images
+    int32_t w, h;                 // Size of the image, signed so that w + d is negative for d < -w
+    IntegralImage iil, iir;       // Window sums of both images
+    uint8_t *dmap;                // Disparity map
+} SpecFrame;
+
+static void SpecBegin(SpecFrame *f, const PaddedImage *left, const PaddedImage *right)
+{
+    f->ldata = left->data;
+    f->rdata = right->data;
+    f->stride = left->stride;
+    f->w = left->w;
+    f->h = left->h;
+    f->dmap = (uint8_t *)malloc(f->w * f->h); // Memory allocation for the disparity map
+    BuildIntegralImage(&f->iil, left);
+    BuildIntegralImage(&f->iir, right);
+}
+
+static uint8_t *SpecEnd(SpecFrame *f)
+{
+    FreeIntegralImage(&f->iil);
+    FreeIntegralImage(&f->iir);
+    return f->dmap;
+}
+
+// One row of the disparity map
+static inline __attribute__((always_inline)) void ZNCCSpecRow(const SpecFrame *f, int32_t i, const int32_t bsx, const int32_t bsy, int32_t mind, const int32_t ndisp)
+{
+    const uint8_t *ldata = f->ldata, *rdata = f->rdata;
+    const IntegralImage *iil = &f->iil, *iir = &f->iir;
+    uint32_t stride = f->stride;
+    int32_t w = f->w, h = f->h;
+    uint8_t *dmap = f->dmap;
+    int32_t bsize = bsx * bsy; // Block size
+    int32_t maxd = mind + ndisp - 1;
+    int32_t r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+    int32_t r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+    bool full_rows = (r0 == i - bsy / 2) && (r1 == i + bsy / 2);
+    int32_t jlo = bsx / 2 + (maxd > 0 ? maxd : 0);  // Pixels whose window is never clipped for any d,
+    int32_t jhi = w - bsx / 2 + (mind < 0 ? mind : 0); // [jlo, jhi]
+    int32_t lwin[2 * (bsy / 2) * 2 * (bsx / 2)];      // Left window of an interior pixel
+    int32_t j, k, d, r, c, i_b, j_b;
+    int32_t c0, c1;
+    int32_t best_d;
+    int64_t n, sl, sr, sll, srr, slr;
+    double current_score, best_score;
+
+    for (j = 0; j < w; j++)
+    {
+        best_d = maxd;
+        best_score = -1;
+
+        if (full_rows && j >= jlo && j <= jhi)
+        {
+            // The left window and its statistics are the same for every d: read them once
+            const uint8_t *lp = ldata + r0 * stride + j - bsx / 2;
+            for (i_b = 0; i_b < 2 * (bsy / 2); i_b++)
+            {
+                for (j_b = 0; j_b < 2 * (bsx / 2); j_b++)
+                    lwin[i_b * 2 * (bsx / 2) + j_b] = lp[i_b * stride + j_b];
+            }
+            c0 = j - bsx / 2;
+            c1 = j + bsx / 2;
+            n = (int64_t)(r1 - r0) * (c1 - c0);
+            sl = RectSum(iil->sum, iil->stride, r0, r1, c0, c1);
+            sll = RectSum(iil->sqsum, iil->stride, r0, r1, c0, c1);
+
+            for (k = 0; k < ndisp; k++)
+            {
+                // Constant trip counts: unrolled in the specialized copies
+                const uint8_t *rp = rdata + r0 * stride + c0 - (mind + k);
+                int32_t acc = 0;
+                for (i_b = 0; i_b < 2 * (bsy / 2); i_b++)
+                {
+                    for (j_b = 0; j_b < 2 * (bsx / 2); j_b++)
+                        acc += lwin[i_b * 2 * (bsx / 2) + j_b] * rp[i_b * stride + j_b];
+                }
+                sr = RectSum(iir->sum, iir->stride, r0, r1, c0 - (mind + k), c1 - (mind + k));
+                srr = RectSum(iir->sqsum, iir->stride, r0, r1, c0 - (mind + k), c1 - (mind + k));
+
+                current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, acc);
+                if (current_score > best_score)
+                {
+                    best_score = current_score;
+                    best_d = mind + k;
+                }
+            }
+            dmap[i * w + j] = (uint8_t)abs(best_d);
+            continue;
+        }
+
+        // Border pixels: windows clipped exactly like the border checks of CALCZNCC
+        for (k = 0; k < ndisp; k++)
+        {
+            d = mind + k;
+            c0 = j - bsx / 2;
+            if (c0 < 0)
+                c0 = 0;
+            if (c0 < d)
+                c0 = d;
+            c1 = j + bsx / 2;
+            if (c1 > w)
+                c1 = w;
+            if (c1 > w + d)
+                c1 = w + d;
+            if (c1 <= c0 || r1 <= r0)
+                continue;
+
+            slr = 0;
+            for (r = r0; r < r1; r++)
+            {
+                const uint8_t *lrow = ldata + r * stride;
+                const uint8_t *rrow = rdata + r * stride - d;
+                int32_t acc = 0;
+                for (c = c0; c < c1; c++)
+                    acc += lrow[c] * rrow[c];
+                slr += acc;
+            }
+
+            n = (int64_t)(r1 - r0) * (c1 - c0);
+            sl = RectSum(iil->sum, iil->stride, r0, r1, c0, c1);
+            sll = RectSum(iil->sqsum, iil->stride, r0, r1, c0, c1);
+            sr = RectSum(iir->sum, iir->stride, r0, r1, c0 - d, c1 - d);
+            srr = RectSum(iir->sqsum, iir->stride, r0, r1, c0 - d, c1 - d);
+
+            current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+            // Selecting the best disparity
+            if (current_score > best_score)
+            {
+                best_score = current_score;
+                best_d = d;
+            }
+        }
+        dmap[i * w + j] = (uint8_t)abs(best_d); // Considering both Left to Right and Right to left disparities
+    }
+}
+
+// Fallback for any other configuration, with the sizes as run-time values
+static uint8_t *ZNCCSpecGeneric(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t ndisp)
+{
+    SpecFrame f;
+    int32_t i;
+
+    SpecBegin(&f, left, right);
+    #pragma omp parallel for
+    for (i = 0; i < f.h; i++)
+        ZNCCSpecRow(&f, i, bsx, bsy, mind, ndisp);
+    return SpecEnd(&f);
+}
+
+#define ZNCC_SPEC(BX, BY, ND)                                                                                      \
+    static uint8_t *ZNCCSpec_##BX##x##BY##_##ND(const PaddedImage *left, const PaddedImage *right, int32_t mind) \
+    {                                                                                                              \
+        SpecFrame f;                                                                                               \
+        int32_t i;                                                                                                 \
+                                                                                                                   \
+        SpecBegin(&f, left, right);                                                                                \
+        _Pragma("omp parallel for")                                                                                \
+        for (i = 0; i < f.h; i++)                                                                                  \
+            ZNCCSpecRow(&f, i, BX, BY, mind, ND);                                                                  \
+        return SpecEnd(&f);                                                                                        \
+    }
+
+// Instantiations: the window sizes of Phase3 (15x7) and Phase4/5 (9x9) plus common rig settings
+ZNCC_SPEC(5, 5, 64)
+ZNCC_SPEC(5, 5, 66)
+ZNCC_SPEC(5, 5, 128)
+ZNCC_SPEC(7, 7, 64)
+ZNCC_SPEC(7, 7, 66)
+ZNCC_SPEC(7, 7, 128)
+ZNCC_SPEC(9, 9, 64)
+ZNCC_SPEC(9, 9, 66)
+ZNCC_SPEC(9, 9, 128)
+ZNCC_SPEC(15, 7, 64)
+ZNCC_SPEC(15, 7, 66)
+ZNCC_SPEC(15, 7, 128)
+
+static const struct
+{
+    int32_t bsx, bsy, ndisp;
+    uint8_t *(*fn)(const PaddedImage *left, const PaddedImage *right, int32_t mind);
+} SpecKernels[] = {
+    {5, 5, 64, ZNCCSpec_5x5_64},
+    {5, 5, 66, ZNCCSpec_5x5_66},
+    {5, 5, 128, ZNCCSpec_5x5_128},
+    {7, 7, 64, ZNCCSpec_7x7_64},
+    {7, 7, 66, ZNCCSpec_7x7_66},
+    {7, 7, 128, ZNCCSpec_7x7_128},
+    {9, 9, 64, ZNCCSpec_9x9_64},
+    {9, 9, 66, ZNCCSpec_9x9_66},
+    {9, 9, 128, ZNCCSpec_9x9_128},
+    {15, 7, 64, ZNCCSpec_15x7_64},
+    {15, 7, 66, ZNCCSpec_15x7_66},
+    {15, 7, 128, ZNCCSpec_15x7_128},
+};
+
+static int32_t FindSpecKernel(int32_t bsx, int32_t bsy, int32_t ndisp)
+{
+    int32_t k;
+
+    for (k = 0; k < sizeof(SpecKernels) / sizeof(SpecKernels[0]); k++)
+    {
+        if (SpecKernels[k].bsx == bsx && SpecKernels[k].bsy == bsy && SpecKernels[k].ndisp == ndisp)
+            return k;
+    }
+    return -1;
+}
+
+bool ZNCCSpecAvailable(int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    return FindSpecKernel(bsx, bsy, maxd - mind + 1) >= 0;
+}
+
+uint8_t *CALCZNCC_SPEC(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    int32_t k = FindSpecKernel(bsx, bsy, maxd - mind + 1);
+
+    if (k >= 0)
+        return SpecKernels[k].fn(left, right, mind);
+    return ZNCCSpecGeneric(left, right, bsx, bsy, mind, maxd - mind + 1);
+}
@@ -0,0 +1,189 @@
+#include <string.h>
+#include "zncc.h"
+
+void resizegray_row(const uint8_t *imageL, const uint8_t *imageR, uint8_t *rowL, uint8_t *rowR, uint32_t w, int32_t i)
+{
+    /* Row i of the downscaled images, from originals of width w */
+    int32_t j;                // Column of the resized image
+    int32_t new_w = w / 4;    // Width of the downscaled image
+    int32_t orig_i, orig_j;   // Indices of the original image
+
+    // Calculating corresponding indices in the original image
+    orig_i = (4 * i - 1 * (i > 0));
+    for (j = 0; j < new_w; j++)
+    {
+        orig_j = (4 * j - 1 * (j > 0));
+        // Grayscaling
+        rowL[j] = 0.2126 * imageL[orig_i * (4 * w) + 4 * orig_j] + 0.7152 * imageL[orig_i * (4 * w) + 4 * orig_j + 1] + 0.0722 * imageL[orig_i * (4 * w) + 4 * orig_j + 2];
+        rowR[j] = 0.2126 * imageR[orig_i * (4 * w) + 4 * orig_j] + 0.7152 * imageR[orig_i * (4 * w) + 4 * orig_j + 1] + 0.0722 * imageR[orig_i * (4 * w) + 4 * orig_j + 2];
+    }
+}
+
+void resizegray(const uint8_t *imageL, const uint8_t *imageR, PaddedImage *resizedL, PaddedImage *resizedR, uint32_t w, uint32_t h)
+{
+    /* Downscaling and conversion to 8bit grayscale image, written into the interior of the padded images */
+
+    int32_t i;            // Row of the resized image
+    int32_t new_h = h / 4; // Height of the downscaled image
+
+    // Iterating through the rows of the downscaled image
+    #pragma omp parallel for
+    for (i = 0; i < new_h; i++)
+        resizegray_row(imageL, imageR, resizedL->data + i * resizedL->stride, resizedR->data + i * resizedR->stride, w, i);
+}
+
+void grayscale(const uint8_t *imageL, const uint8_t *imageR, PaddedImage *grayL, PaddedImage *grayR)
+{
+    /* Conversion to 8bit grayscale image at full resolution, written into the interior of the padded images */
+    int32_t i, j;
+    int32_t w = grayL->w, h = grayL->h;
+
+    #pragma omp parallel for private(j)
+    for (i = 0; i < h; i++)
+    {
+        const uint8_t *pixL = imageL + i * (4 * w);
+        const uint8_t *pixR = imageR + i * (4 * w);
+        uint8_t *rowL = grayL->data + i * grayL->stride;
+        uint8_t *rowR = grayR->data + i * grayR->stride;
+        for (j = 0; j < w; j++)
+        {
+            rowL[j] = 0.2126 * pixL[4 * j] + 0.7152 * pixL[4 * j + 1] + 0.0722 * pixL[4 * j + 2];
+            rowR[j] = 0.2126 * pixR[4 * j] + 0.7152 * pixR[4 * j + 1] + 0.0722 * pixR[4 * j + 2];
+        }
+    }
+}
+
+void rescale_dmap(uint8_t *arr, int32_t imsize, uint8_t min, uint8_t max)
+{
+    int32_t i;
+
+    #pragma omp parallel for
+    for (i = 0; i < imsize; i++)
+    {
+        arr[i] = max > min ? (uint8_t)(255 * (arr[i] - min) / (max - min)) : 0;
+    }
+}
+
+void normalize_dmap(uint8_t *arr, uint32_t w, uint32_t h)
+{
+    uint8_t max = 0;
+    uint8_t min = UCHAR_MAX;
+    int32_t imsize = w * h;
+    int32_t i;
+    // Min and max of the whole map as a parallel reduction
+    #pragma omp parallel for reduction(max : max) reduction(min : min)
+    for (i = 0; i < imsize; i++)
+    {
+        if (arr[i] > max)
+            max = arr[i];
+        if (arr[i] < min)
+            min = arr[i];
+    }
+
+    rescale_dmap(arr, imsize, min, max);
+}
+
+void CrossCheckRow(const uint8_t *row1, const uint8_t *row2, uint8_t *row, uint32_t w, uint32_t threshold)
+{
+    int32_t j;
+
+    for (j = 0; j < w; j++)
+    {
+        if (abs((int32_t)row1[j] - row2[j]) > threshold) // Remember about the trick for Rigth to left disprity in zncc!!
+            row[j] = 0;
+        else
+            row[j] = row1[j];
+    }
+}
+
+void CrossCheckRows(const uint8_t *map1, const uint8_t *map2, PaddedImage *map, uint32_t threshold, int32_t r0, int32_t r1)
+{
+    uint32_t w = map->w;
+    int32_t i;
+
+    for (i = r0; i < r1; i++)
+        CrossCheckRow(map1 + i * w, map2 + i * w, map->data + i * map->stride, w, threshold);
+}
+
+void CrossCheck(const uint8_t *map1, const uint8_t *map2, PaddedImage *map, uint32_t dmax, uint32_t threshold)
+{
+    /* Writes the interior of map, whose halo stays zero: an invalid disparity for OcclusionFill */
+    int32_t i;
+
+    #pragma omp parallel for
+    for (i = 0; i < map->h; i++)
+        CrossCheckRows(map1, map2, map, threshold, i, i + 1);
+}
+
+uint8_t FillPixel(const uint8_t *const *rows, int32_t j, int32_t ib0, int32_t ib1, uint32_t nsize)
+{
+    /*
+     * Nearest non-zero value around column j of rows[0], searched in squares of growing
+     * size; rows[i_b] must exist for i_b in [ib0, ib1], the other rows are skipped.
+     * Returns 0 when the whole neighbourhood is occluded.
+     */
+    int32_t i_b, j_b; // Indices within the block
+    int32_t ext, lo, hi;
+
+    // Spreading search of non-zero pixel in the neighborhood
+    for (ext = 1; ext <= nsize / 2; ext++)
+    {
+        lo = -ext > ib0 ? -ext : ib0;
+        hi = ext < ib1 ? ext : ib1;
+        for (j_b = -ext; j_b <= ext; j_b++)
+        {
+            for (i_b = lo; i_b <= hi; i_b++)
+            {
+                // No column checks: the halo and the center itself are zero
+                //If we meet a nonzero pixel, we interpolate and quite from this loop
+                if (rows[i_b][j + j_b] != 0)
+                    return rows[i_b][j + j_b];
+            }
+        }
+    }
+    return 0;
+}
+
+uint8_t *OcclusionFill(const PaddedImage *map, uint32_t nsize)
+{
+    /*
+     * The halo of map must be zero and at least nsize / 2 wide: neighbours outside the
+     * image then read as zeros, which are skipped like the occluded pixels themselves,
+     * so the search needs no border checks.
+     */
+    int32_t w = map->w, h = map->h; // Size of the image
+    int32_t stride = map->stride;
+    int32_t imsize = w * h;
+    int32_t half = nsize / 2;
+
+    uint8_t *result;
+    const uint8_t **rows; // Rows of the map and of its top and bottom halos
+    int32_t i, j;     // Indices for rows and colums respectively
+
+    if (Fill != FILL_SEARCH)
+        return OcclusionFillSweep(map, nsize, Fill == FILL_RING);
+    if (map->mode != HALO_ZERO || map->halo < half)
+    {
+        printf("OcclusionFill needs a zero halo of %u pixels\n", half);
+        return NULL;
+    }
+    result = (uint8_t *)malloc(imsize);
+    rows = (const uint8_t **)malloc((h + 2 * half) * sizeof(uint8_t *));
+    for (i = -half; i < h + half; i++)
+        rows[i + half] = map->data + i * stride;
+
+    // Occluded pixels cost far more than the others: rows are handed out dynamically
+    #pragma omp parallel for private(j) schedule(dynamic)
+    for (i = 0; i < h; i++)
+    {
+        for (j = 0; j < w; j++)
+        {
+            // If the value of the pixel is zero, perform the occlusion filling by nearest neighbour interpolation
+            result[i * w + j] = rows[i + half][j];
+            if (result[i * w + j] == 0)
+                result[i * w + j] = FillPixel(rows + i + half, j, -half, half, nsize);
+        }
+    }
+    free(rows);
+    return result;
+}
@@ -0,0 +1,181 @@
+#include <omp.h>
+#include <string.h>
+#include "zncc.h"
+#include "stereo.h"
+
+/*
+ * Everything a frame needs is carved out of one arena when the context is built:
+ * the padded grayscale pair, their integral images, the LR and RL maps, the padded
+ * cross-checked map with the row table of the fill, and the per-thread rows of the
+ * winner-take-all. StereoCompute then runs the stages as worksharing loops of one
+ * parallel region, so the frame costs one wake-up of the team and no allocation.
+ */
+
+struct StereoContext
+{
+    StereoParams p;
+    uint32_t w, h;   // Size of the input images
+    uint32_t mw, mh; // Size of the maps
+    uint8_t *arena;  // Single allocation holding everything below
+    PaddedImage grayL, grayR, checked;
+    IntegralImage iil, iir;
+    uint8_t *lr, *rl;
+    const uint8_t **rows; // Rows of checked, halos included, for FillPixel
+    double *best_score;   // mw entries per thread
+    int32_t *best_d;      // mw entries per thread
+};
+
+static size_t Carve(size_t *offset, size_t bytes)
+{
+    /* Offset of the next IMAGE_ALIGN aligned block of bytes in the arena */
+    size_t at = (*offset + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+
+    *offset = at + bytes;
+    return at;
+}
+
+StereoContext *StereoCreate(uint32_t w, uint32_t h, const StereoParams *params)
+{
+    StereoContext *ctx;
+    uint32_t mw = w / 4, mh = h / 4;
+    uint32_t halo, half;
+    size_t size = 0, table;
+    size_t at_grayL, at_grayR, at_checked, at_iil, at_iir, at_lr, at_rl, at_rows, at_score, at_d;
+    int32_t threads, i;
+
+    if (mw < 1 || mh < 1 || params->bsx < 2 || params->bsy < 2 || params->maxd < 0 || params->maxd > UCHAR_MAX || params->maxd >= mw || params->nsize < 2)
+        return NULL;
+    threads = params->threads > 0 ? params->threads : omp_get_max_threads();
+    halo = ZNCCKernelHalo(params->bsx, params->maxd);
+    half = params->nsize / 2;
+    table = (size_t)(mw + 1) * (mh + 1) * sizeof(int64_t);
+
+    at_grayL = Carve(&size, PaddedImageBytes(mw, mh, halo));
+    at_grayR = Carve(&size, PaddedImageBytes(mw, mh, halo));
+    at_checked = Carve(&size, PaddedImageBytes(mw, mh, half));
+    at_iil = Carve(&size, 2 * table);
+    at_iir = Carve(&size, 2 * table);
+    at_lr = Carve(&size, (size_t)mw * mh);
+    at_rl = Carve(&size, (size_t)mw * mh);
+    at_rows = Carve(&size, (mh + 2 * half) * sizeof(uint8_t *));
+    at_score = Carve(&size, (size_t)threads * mw * sizeof(double));
+    at_d = Carve(&size, (size_t)threads * mw * sizeof(int32_t));
+
+    ctx = (StereoContext *)malloc(sizeof(StereoContext));
+    if (!ctx)
+        return NULL;
+    if (posix_memalign((void **)&ctx->arena, IMAGE_ALIGN, size) != 0)
+    {
+        free(ctx);
+        return NULL;
+    }
+    ctx->p = *params;
+    ctx->p.threads = threads;
+    ctx->w = w;
+    ctx->h = h;
+    ctx->mw = mw;
+    ctx->mh = mh;
+
+    PlacePaddedImage(&ctx->grayL, ctx->arena + at_grayL, mw, mh, halo);
+    PlacePaddedImage(&ctx->grayR, ctx->arena + at_grayR, mw, mh, halo);
+    PlacePaddedImage(&ctx->checked, ctx->arena + at_checked, mw, mh, half);
+
+    // The first row and column of the tables stay zero, IntegralRows only fills the others
+    ctx->iil.w = ctx->iir.w = mw;
+    ctx->iil.h = ctx->iir.h = mh;
+    ctx->iil.stride = ctx->iir.stride = mw + 1;
+    ctx->iil.sum = (int64_t *)(ctx->arena + at_iil);
+    ctx->iil.sqsum = (int64_t *)(ctx->arena + at_iil + table);
+    ctx->iir.sum = (int64_t *)(ctx->arena + at_iir);
+    ctx->iir.sqsum = (int64_t *)(ctx->arena + at_iir + table);
+    memset(ctx->arena + at_iil, 0, 2 * table);
+    memset(ctx->arena + at_iir, 0, 2 * table);
+
+    ctx->lr = ctx->arena + at_lr;
+    ctx->rl = ctx->arena + at_rl;
+    ctx->rows = (const uint8_t **)(ctx->arena + at_rows);
+    for (i = -(int32_t)half; i < (int32_t)(mh + half); i++)
+        ctx->rows[i + half] = ctx->checked.data + i * (int32_t)ctx->checked.stride;
+    ctx->best_score = (double *)(ctx->arena + at_score);
+    ctx->best_d = (int32_t *)(ctx->arena + at_d);
+
+    return ctx;
+}
+
+void StereoCompute(StereoContext *ctx, const uint8_t *left, const uint8_t *right, uint8_t *out)
+{
+    int32_t w = ctx->mw, h = ctx->mh;
+    int32_t bsx = ctx->p.bsx, bsy = ctx->p.bsy, maxd = ctx->p.maxd;
+    int32_t half = ctx->p.nsize / 2;
+    uint8_t min = UCHAR_MAX, max = 0;
+
+    #pragma omp parallel num_threads(ctx->p.threads)
+    {
+        int32_t me = omp_get_thread_num();
+        double *best_score = ctx->best_score + (size_t)me * w;
+        int32_t *best_d = ctx->best_d + (size_t)me * w;
+        int32_t i, j;
+
+        #pragma omp for
+        for (i = 0; i < h; i++)
+        {
+            resizegray_row(left, right, ctx->grayL.data + i * ctx->grayL.stride, ctx->grayR.data + i * ctx->grayR.stride, ctx->w, i);
+            IntegralRows(&ctx->iil, &ctx->grayL, i, i + 1);
+            IntegralRows(&ctx->iir, &ctx->grayR, i, i + 1);
+        }
+
+        #pragma omp for
+        for (j = 1; j < w + 1; j += 64)
+        {
+            IntegralColumns(&ctx->iil, j, j + 64 < w + 1 ? j + 64 : w + 1);
+            IntegralColumns(&ctx->iir, j, j + 64 < w + 1 ? j + 64 : w + 1);
+        }
+
+        #pragma omp for
+        for (i = 0; i < h; i++)
+        {
+            ZNCCSimdRows(&ctx->grayL, &ctx->grayR, &ctx->iil, &ctx->iir, 0, h, i, i + 1, bsx, bsy, 0, maxd, best_score, best_d, ctx->lr, NULL, NULL);
+            ZNCCSimdRows(&ctx->grayR, &ctx->grayL, &ctx->iir, &ctx->iil, 0, h, i, i + 1, bsx, bsy, -maxd, 0, best_score, best_d, ctx->rl, NULL, NULL);
+        }
+
+        #pragma omp for
+        for (i = 0; i < h; i++)
+            CrossCheckRow(ctx->lr + i * w, ctx->rl + i * w, ctx->checked.data + i * ctx->checked.stride, w, ctx->p.threshold);
+
+        // Occluded pixels cost far more than the others: rows are handed out dynamically
+        #pragma omp for schedule(dynamic) reduction(min : min) reduction(max : max)
+        for (i = 0; i < h; i++)
+        {
+            const uint8_t *const *row = ctx->rows + i + half;
+            for (j = 0; j < w; j++)
+            {
+                uint8_t v = row[0][j];
+                if (v == 0)
+                    v = FillPixel(row, j, -half, half, ctx->p.nsize);
+                out[i * w + j] = v;
+                if (v < min)
+                    min = v;
+                if (v > max)
+                    max = v;
+            }
+        }
+
+        #pragma omp for
+        for (i = 0; i < w * h; i++)
+            out[i] = max > min ? (uint8_t)(255 * (out[i] - min) / (max - min)) : 0; // A uniform frame maps to 0, as in PostProcess
+    }
+}
+
+void StereoMaps(const StereoContext *ctx, const uint8_t **lr, const uint8_t **rl)
+{
+    *lr = ctx->lr;
+    *rl = ctx->rl;
+}
+
+void StereoDestroy(StereoContext *ctx)
+{
+    if (!ctx)
+        return;
+    free(ctx->arena);
+    free(ctx);
+}
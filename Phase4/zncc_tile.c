@@ -0,0 +1,268 @@
+#include <string.h>
+#include <sys/time.h>
+#include "zncc.h"
+
+/*
+ * Cache-blocked traversal: the image is cut into (row band x column tile) blocks and
+ * each block walks the disparity range in chunks. The rows of a band touched by one
+ * chunk span only tile + chunk + bsx columns of the right image and tile + bsx of
+ * the left, so they stay in L1/L2 across the disparities of the chunk instead of
+ * being reloaded from memory for every pixel as in CALCZNCC. The cross term comes
+ * from the vector kernels of CALCZNCC_SIMD, the window statistics from the integral
+ * images.
+ */
+
+static TileConfig Tiles;      // Block sizes used by CALCZNCC_TILE, set by ZNCCTileProbe
+static bool TilesSet = false;
+
+typedef struct
+{
+    const PaddedImage *left, *right;
+    const IntegralImage *iil, *iir;
+    int32_t bsx, bsy, mind, maxd;
+    bool padded; // Zero halos: the kernel can score the border pixels as well
+    CrossTermKernel kernel;
+    int32_t lanes;
+} TileJob;
+
+static void TileBlock(const TileJob *job, const TileConfig *cfg, int32_t b0, int32_t b1, int32_t t0, int32_t t1, double *best_score, int32_t *best_d)
+{
+    /* Best disparities of rows [b0, b1) x columns [t0, t1), in the band arrays of width t1 - t0 */
+    int32_t w = job->left->w, h = job->left->h;
+    int32_t stride = job->left->stride;
+    int32_t bsx = job->bsx, bsy = job->bsy;
+    int32_t bsize = bsx * bsy;
+    int32_t tw = t1 - t0;
+    int32_t taps = 2 * (bsx / 2);
+    int32_t i, j, d, d0, d1;
+    int32_t r0, r1, c0, c1;
+    int32_t slr_block[16];
+    int64_t n, sl, sr, sll, srr, slr;
+    double current_score;
+
+    for (i = 0; i < (b1 - b0) * tw; i++)
+    {
+        best_score[i] = -1;
+        best_d[i] = job->maxd;
+    }
+
+    for (d0 = job->mind; d0 <= job->maxd; d0 += cfg->chunk)
+    {
+        d1 = d0 + cfg->chunk - 1 < job->maxd ? d0 + cfg->chunk - 1 : job->maxd;
+        for (i = b0; i < b1; i++)
+        {
+            r0 = i - bsy / 2 > 0 ? i - bsy / 2 : 0;
+            r1 = i + bsy / 2 < h ? i + bsy / 2 : h;
+            if (r1 <= r0)
+                continue;
+
+            // d ascends inside the chunk and the chunks ascend, so ties keep the smallest d as in CALCZNCC
+            for (d = d0; d <= d1; d++)
+            {
+                for (j = t0; j < t1; j++)
+                {
+                    // Taps outside either image read halo zeros, so the kernel covers the whole tile
+                    if (job->padded && (j - t0) % job->lanes == 0)
+                        job->kernel(job->left->data, job->right->data, stride, r0, r1, j - bsx / 2, taps, d, slr_block);
+
+                    c0 = j - bsx / 2;
+                    if (c0 < 0)
+                        c0 = 0;
+                    if (c0 < d)
+                        c0 = d;
+                    c1 = j + bsx / 2;
+                    if (c1 > w)
+                        c1 = w;
+                    if (c1 > w + d)
+                        c1 = w + d;
+                    if (c1 <= c0)
+                        continue;
+
+                    if (job->padded)
+                        slr = slr_block[(j - t0) % job->lanes];
+                    else
+                        slr = CrossTermClipped(job->left->data, job->right->data, stride, r0, r1, c0, c1, d);
+
+                    n = (int64_t)(r1 - r0) * (c1 - c0);
+                    sl = RectSum(job->iil->sum, job->iil->stride, r0, r1, c0, c1);
+                    sll = RectSum(job->iil->sqsum, job->iil->stride, r0, r1, c0, c1);
+                    sr = RectSum(job->iir->sum, job->iir->stride, r0, r1, c0 - d, c1 - d);
+                    srr = RectSum(job->iir->sqsum, job->iir->stride, r0, r1, c0 - d, c1 - d);
+
+                    current_score = ZNCCFromSums(n, bsize, sl, sr, sll, srr, slr);
+                    if (current_score > best_score[(i - b0) * tw + (j - t0)])
+                    {
+                        best_score[(i - b0) * tw + (j - t0)] = current_score;
+                        best_d[(i - b0) * tw + (j - t0)] = d;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static double Seconds(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void ZNCCTileProbe(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /*
+     * Picks the block sizes once per run: every candidate scores the same strip of
+     * 8 rows from the middle of the image on one thread and the fastest one is kept.
+     * ZNCC_TILE=<cols>x<rows>x<chunk> skips the probe.
+     */
+    static const int32_t cols[] = {32, 64, 128};
+    static const int32_t rows[] = {4, 8};
+    static const int32_t chunks[] = {16, 32, 0}; // 0: the whole disparity range
+    const char *env = getenv("ZNCC_TILE");
+    int32_t ndisp = maxd - mind + 1;
+    int32_t a, b, k;
+    int32_t s0, s1, sw;
+    double best_time = -1;
+    double *best_score;
+    int32_t *best_d;
+    IntegralImage iil, iir;
+    TileJob job;
+    TileConfig cfg;
+
+    if (TilesSet)
+        return;
+    TilesSet = true;
+
+    if (env && sscanf(env, "%dx%dx%d", &Tiles.cols, &Tiles.rows, &Tiles.chunk) == 3 && Tiles.cols > 0 && Tiles.rows > 0 && Tiles.chunk > 0)
+        return;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+    job.left = left;
+    job.right = right;
+    job.iil = &iil;
+    job.iir = &iir;
+    job.bsx = bsx;
+    job.bsy = bsy;
+    job.mind = mind;
+    job.maxd = maxd;
+    job.padded = ZeroHaloCovers(left, right, bsx, mind, maxd);
+    job.kernel = SelectCrossTermKernel(&job.lanes);
+
+    // A strip of 8 rows x up to 256 columns: a multiple of every candidate
+    s0 = left->h / 2 > 4 ? left->h / 2 - 4 : 0;
+    s1 = s0 + 8 < left->h ? s0 + 8 : left->h;
+    sw = left->w < 256 ? left->w : 256;
+    best_score = (double *)malloc(8 * 128 * sizeof(double));
+    best_d = (int32_t *)malloc(8 * 128 * sizeof(int32_t));
+
+    for (a = 0; a < sizeof(cols) / sizeof(cols[0]); a++)
+    {
+        for (b = 0; b < sizeof(rows) / sizeof(rows[0]); b++)
+        {
+            for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++)
+            {
+                int32_t r, t;
+                double t_start, elapsed;
+
+                cfg.cols = cols[a];
+                cfg.rows = rows[b];
+                cfg.chunk = chunks[k] > 0 ? chunks[k] : ndisp;
+                if (chunks[k] >= ndisp)
+                    continue; // Same as the whole range
+
+                t_start = Seconds();
+                for (r = s0; r < s1; r += cfg.rows)
+                {
+                    for (t = 0; t < sw; t += cfg.cols)
+                        TileBlock(&job, &cfg, r, r + cfg.rows < s1 ? r + cfg.rows : s1, t, t + cfg.cols < sw ? t + cfg.cols : sw, best_score, best_d);
+                }
+                elapsed = Seconds() - t_start;
+                if (best_time < 0 || elapsed < best_time)
+                {
+                    best_time = elapsed;
+                    Tiles = cfg;
+                }
+            }
+        }
+    }
+
+    free(best_score);
+    free(best_d);
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+}
+
+TileConfig ZNCCTileConfig(void)
+{
+    return Tiles;
+}
+
+void ZNCCSetTileConfig(TileConfig cfg)
+{
+    Tiles = cfg;
+    TilesSet = true;
+}
+
+uint8_t *CALCZNCC_TILE(const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t mind, int32_t maxd)
+{
+    /* Disparity map computation over cache-sized blocks, one block per work item */
+    uint32_t w = left->w, h = left->h; // Size of the image
+    int32_t imsize = w * h;
+    uint8_t *dmap = (uint8_t *)malloc(imsize); // Memory allocation for the disparity map
+    IntegralImage iil, iir;
+    TileJob job;
+    TileConfig cfg;
+    int32_t nbands, ntiles;
+
+    ZNCCTileProbe(left, right, bsx, bsy, mind, maxd);
+    cfg = Tiles;
+    nbands = (h + cfg.rows - 1) / cfg.rows;
+    ntiles = (w + cfg.cols - 1) / cfg.cols;
+
+    BuildIntegralImage(&iil, left);
+    BuildIntegralImage(&iir, right);
+    job.left = left;
+    job.right = right;
+    job.iil = &iil;
+    job.iir = &iir;
+    job.bsx = bsx;
+    job.bsy = bsy;
+    job.mind = mind;
+    job.maxd = maxd;
+    job.padded = ZeroHaloCovers(left, right, bsx, mind, maxd);
+    job.kernel = SelectCrossTermKernel(&job.lanes);
+
+    #pragma omp parallel shared(job, cfg, dmap)
+    {
+        double *best_score = (double *)malloc(cfg.rows * cfg.cols * sizeof(double));
+        int32_t *best_d = (int32_t *)malloc(cfg.rows * cfg.cols * sizeof(int32_t));
+        int32_t block;
+
+        #pragma omp for schedule(dynamic)
+        for (block = 0; block < nbands * ntiles; block++)
+        {
+            int32_t b0 = block / ntiles * cfg.rows;
+            int32_t b1 = b0 + cfg.rows < h ? b0 + cfg.rows : h;
+            int32_t t0 = block % ntiles * cfg.cols;
+            int32_t t1 = t0 + cfg.cols < w ? t0 + cfg.cols : w;
+            int32_t i, j;
+
+            TileBlock(&job, &cfg, b0, b1, t0, t1, best_score, best_d);
+            for (i = b0; i < b1; i++)
+            {
+                for (j = t0; j < t1; j++)
+                    dmap[i * w + j] = (uint8_t)abs(best_d[(i - b0) * (t1 - t0) + (j - t0)]); // Considering both Left to Right and Right to left disparities
+            }
+        }
+
+        free(best_score);
+        free(best_d);
+    }
+
+    FreeIntegralImage(&iil);
+    FreeIntegralImage(&iir);
+
+    return dmap;
+}
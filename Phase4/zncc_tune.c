@@ -0,0 +1,304 @@
+#include <omp.h>
+#include <string.h>
+#include <unistd.h>
+#include "zncc.h"
+
+/*
+ * Autotuner. Two sweeps of the selected engine on the frame being processed: thread
+ * counts (powers of two, the physical cores and all hardware threads) under the
+ * current settings, then, at the best count, the knob of the engine if it has one:
+ * scheduler kind and initial tile of naive, schedule kind and chunk of the simd row
+ * loop, block sizes of tile. Every candidate is timed as the fastest of TUNE_REPEAT
+ * LR passes. The winner is stored as one line per host, image size, window,
+ * disparity range and engine in the cache file, and TuneLoad finds it again in
+ * later runs.
+ */
+
+#define TUNE_REPEAT 3
+#define TUNE_MAX_LINE 512
+
+LoopSchedule RowLoop = {LOOP_STATIC, 0};
+
+static const char *LoopNames[] = {"static", "dynamic", "guided"};
+static const char *SchedNames[] = {"static", "steal"};
+
+void SetLoopSchedule(const LoopSchedule *s)
+{
+    static const omp_sched_t kinds[] = {omp_sched_static, omp_sched_dynamic, omp_sched_guided};
+
+    omp_set_schedule(kinds[s->kind], s->chunk);
+}
+
+static int32_t PhysicalCores(void)
+{
+    /* CPUs that are the first thread of their core, all of them when the topology is not readable */
+    int32_t nprocs = omp_get_num_procs(), cores = 0, cpu, first;
+    char path[128];
+    FILE *f;
+
+    for (cpu = 0; cpu < nprocs; cpu++)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        f = fopen(path, "r");
+        if (!f)
+            return nprocs;
+        if (fscanf(f, "%d", &first) == 1 && first == cpu)
+            cores++;
+        fclose(f);
+    }
+    return cores > 0 ? cores : nprocs;
+}
+
+static double TimePass(ZNCCEngine engine, const PaddedImage *left, const PaddedImage *right, int32_t bsx, int32_t bsy, int32_t maxd)
+{
+    /* Fastest of TUNE_REPEAT LR passes */
+    double best = -1, t0, t;
+    int32_t k;
+
+    for (k = 0; k < TUNE_REPEAT; k++)
+    {
+        t0 = omp_get_wtime();
+        free(engine(left, right, bsx, bsy, 0, maxd));
+        t = omp_get_wtime() - t0;
+        if (best < 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+TuneResult Autotune(const TuneKey *key, ZNCCEngine engine, const PaddedImage *left, const PaddedImage *right)
+{
+    static const SchedConfig scheds[] = {
+        {SCHED_STATIC, 64}, {SCHED_STEAL, 16}, {SCHED_STEAL, 32}, {SCHED_STEAL, 64}, {SCHED_STEAL, 128},
+    };
+    static const LoopSchedule schedules[] = {
+        {LOOP_STATIC, 0}, {LOOP_STATIC, 1}, {LOOP_STATIC, 4}, {LOOP_STATIC, 16},
+        {LOOP_DYNAMIC, 1}, {LOOP_DYNAMIC, 4}, {LOOP_DYNAMIC, 16},
+        {LOOP_GUIDED, 1}, {LOOP_GUIDED, 4},
+    };
+    static const int32_t cols[] = {32, 64, 128};
+    static const int32_t rows[] = {4, 8, 16};
+    static const int32_t chunks[] = {16, 32, 0}; // 0: the whole disparity range
+    int32_t bsx = key->bsx, bsy = key->bsy, maxd = key->maxd;
+    int32_t nprocs = omp_get_num_procs(), cores = PhysicalCores();
+    int32_t counts[40], ncounts = 0, t, a, b, k;
+    double best, elapsed;
+    TuneResult res;
+    TileConfig cfg;
+
+    // Thread counts: powers of two below the hardware threads, the physical cores and all hardware threads
+    for (t = 1; t < nprocs && ncounts < 32; t *= 2)
+        counts[ncounts++] = t;
+    if (cores < nprocs && (cores & (cores - 1)) != 0)
+        counts[ncounts++] = cores;
+    counts[ncounts++] = nprocs;
+    printf("Autotuning %s on %ux%u, %d hardware threads, %d physical cores\n", key->engine, left->w, left->h, nprocs, cores);
+
+    res.sched = Sched;
+    res.rows = RowLoop;
+    res.tiles = ZNCCTileConfig();
+    best = -1;
+    for (k = 0; k < ncounts; k++)
+    {
+        omp_set_num_threads(counts[k]);
+        elapsed = TimePass(engine, left, right, bsx, bsy, maxd);
+        printf("  threads %3d: %.6f s\n", counts[k], elapsed);
+        if (best < 0 || elapsed < best)
+        {
+            best = elapsed;
+            res.threads = counts[k];
+        }
+    }
+    omp_set_num_threads(res.threads);
+
+    if (strcmp(key->engine, "naive") == 0)
+    {
+        best = -1;
+        for (k = 0; k < sizeof(scheds) / sizeof(scheds[0]); k++)
+        {
+            Sched = scheds[k];
+            elapsed = TimePass(engine, left, right, bsx, bsy, maxd);
+            printf("  sched %s,%d: %.6f s\n", SchedNames[scheds[k].kind], scheds[k].tile, elapsed);
+            if (best < 0 || elapsed < best)
+            {
+                best = elapsed;
+                res.sched = scheds[k];
+            }
+        }
+        Sched = res.sched;
+        SchedResetStats(); // The report covers the timed run only
+    }
+    else if (strcmp(key->engine, "simd") == 0)
+    {
+        best = -1;
+        for (k = 0; k < sizeof(schedules) / sizeof(schedules[0]); k++)
+        {
+            RowLoop = schedules[k];
+            elapsed = TimePass(engine, left, right, bsx, bsy, maxd);
+            printf("  schedule %s,%d: %.6f s\n", LoopNames[schedules[k].kind], schedules[k].chunk, elapsed);
+            if (best < 0 || elapsed < best)
+            {
+                best = elapsed;
+                res.rows = schedules[k];
+            }
+        }
+        RowLoop = res.rows;
+    }
+    else if (strcmp(key->engine, "tile") == 0)
+    {
+        best = -1;
+        for (a = 0; a < sizeof(cols) / sizeof(cols[0]); a++)
+        {
+            for (b = 0; b < sizeof(rows) / sizeof(rows[0]); b++)
+            {
+                for (k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++)
+                {
+                    cfg.cols = cols[a];
+                    cfg.rows = rows[b];
+                    cfg.chunk = chunks[k] > 0 ? chunks[k] : maxd + 1;
+                    if (chunks[k] > maxd)
+                        continue; // Same as the whole range
+                    ZNCCSetTileConfig(cfg);
+                    elapsed = TimePass(engine, left, right, bsx, bsy, maxd);
+                    printf("  tile %dx%dx%d: %.6f s\n", cfg.cols, cfg.rows, cfg.chunk, elapsed);
+                    if (best < 0 || elapsed < best)
+                    {
+                        best = elapsed;
+                        res.tiles = cfg;
+                    }
+                }
+            }
+        }
+        ZNCCSetTileConfig(res.tiles);
+    }
+
+    return res;
+}
+
+static const char *CachePath(char *buf, size_t size)
+{
+    const char *env = getenv("ZNCC_TUNE_CACHE");
+    const char *home = getenv("HOME");
+
+    if (env)
+        return env;
+    if (!home)
+        return "zncc_tune.cache";
+    snprintf(buf, size, "%s/.zncc_tune", home);
+    return buf;
+}
+
+static void HostName(char *buf, size_t size)
+{
+    if (gethostname(buf, size) != 0)
+        snprintf(buf, size, "localhost");
+    buf[size - 1] = 0;
+}
+
+void TuneFormat(const TuneResult *res, char *buf, size_t size)
+{
+    snprintf(buf, size, "threads=%d schedule=%s,%d sched=%s,%d tile=%dx%dx%d", res->threads, LoopNames[res->rows.kind], res->rows.chunk,
+             SchedNames[res->sched.kind], res->sched.tile, res->tiles.cols, res->tiles.rows, res->tiles.chunk);
+}
+
+static int32_t FindName(const char *name, const char *const *names, int32_t n)
+{
+    int32_t k = 0;
+
+    while (k < n && strcmp(name, names[k]) != 0)
+        k++;
+    return k;
+}
+
+static bool ParseEntry(const char *line, char *host, TuneKey *key, char *engine, TuneResult *res)
+{
+    /*
+     * "<host> <w>x<h> window=<bsx>x<bsy> maxd=<maxd> engine=<name> threads=<n>
+     * schedule=<kind>,<chunk> sched=<kind>,<tile> tile=<cols>x<rows>x<chunk>" on one line,
+     * tile=0x0x0 when not probed; engine receives the name, 31 characters at most
+     */
+    char kind[16], skind[16];
+
+    if (sscanf(line, "%255s %ux%u window=%dx%d maxd=%d engine=%31s threads=%d schedule=%15[^,],%d sched=%15[^,],%d tile=%dx%dx%d", host, &key->w,
+               &key->h, &key->bsx, &key->bsy, &key->maxd, engine, &res->threads, kind, &res->rows.chunk, skind, &res->sched.tile, &res->tiles.cols,
+               &res->tiles.rows, &res->tiles.chunk) != 15)
+        return false;
+    key->engine = engine;
+    if (FindName(kind, LoopNames, 3) == 3 || FindName(skind, SchedNames, 2) == 2)
+        return false;
+    res->rows.kind = (LoopKind)FindName(kind, LoopNames, 3);
+    res->sched.kind = (SchedKind)FindName(skind, SchedNames, 2);
+    return res->threads > 0 && res->rows.chunk >= 0 && res->sched.tile > 0 &&
+           ((res->tiles.cols > 0 && res->tiles.rows > 0 && res->tiles.chunk > 0) || (res->tiles.cols == 0 && res->tiles.rows == 0 && res->tiles.chunk == 0));
+}
+
+static bool SameKey(const TuneKey *a, const TuneKey *b)
+{
+    return a->w == b->w && a->h == b->h && a->bsx == b->bsx && a->bsy == b->bsy && a->maxd == b->maxd && strcmp(a->engine, b->engine) == 0;
+}
+
+bool TuneLoad(const TuneKey *key, TuneResult *res)
+{
+    char path[1024], line[TUNE_MAX_LINE], me[256], host[256], engine[32];
+    TuneKey ekey;
+    TuneResult entry;
+    bool found = false;
+    FILE *f = fopen(CachePath(path, sizeof(path)), "r");
+
+    if (!f)
+        return false;
+    HostName(me, sizeof(me));
+    while (fgets(line, sizeof(line), f))
+    {
+        if (ParseEntry(line, host, &ekey, engine, &entry) && strcmp(host, me) == 0 && SameKey(&ekey, key))
+        {
+            *res = entry;
+            found = true;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+bool TuneSave(const TuneKey *key, const TuneResult *res)
+{
+    /* Rewrites the file through a temporary one, keeping the entries of other hosts and keys */
+    char path[1024], tmp[1100], line[TUNE_MAX_LINE], me[256], host[256], engine[32], desc[160];
+    const char *file = CachePath(path, sizeof(path));
+    TuneKey ekey;
+    TuneResult entry;
+    FILE *in, *out;
+
+    HostName(me, sizeof(me));
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    out = fopen(tmp, "w");
+    if (!out)
+        return false;
+    in = fopen(file, "r");
+    if (in)
+    {
+        while (fgets(line, sizeof(line), in))
+        {
+            if (ParseEntry(line, host, &ekey, engine, &entry) && !(strcmp(host, me) == 0 && SameKey(&ekey, key)))
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+    TuneFormat(res, desc, sizeof(desc));
+    fprintf(out, "%s %ux%u window=%dx%d maxd=%d engine=%s %s\n", me, key->w, key->h, key->bsx, key->bsy, key->maxd, key->engine, desc);
+    if (fclose(out) != 0 || rename(tmp, file) != 0)
+    {
+        remove(tmp);
+        return false;
+    }
+    return true;
+}
+
+void TuneApply(const TuneResult *res)
+{
+    omp_set_num_threads(res->threads);
+    Sched = res->sched;
+    RowLoop = res->rows;
+    if (res->tiles.cols > 0) // 0x0x0 when the tile engine was not tuned: its probe still runs
+        ZNCCSetTileConfig(res->tiles);
+}